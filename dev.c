@@ -25,6 +25,12 @@
 #include <linux/blkdev.h>
 #include <linux/sort.h>
 #include <linux/vmalloc.h>
+#include <linux/highmem.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,14,0)
+#include <linux/crc32.h>
+#else
+#include <linux/crc32c.h>
+#endif
 #include "pxd_compat.h"
 #include "pxd_core.h"
 
@@ -484,8 +490,15 @@ static int fuse_notify_add_ext(struct fuse_conn *conn, unsigned int size,
 		struct iov_iter *iter)
 {
 	struct pxd_add_ext_out add;
-	size_t len = sizeof(add);
+	size_t len = min_t(size_t, size, sizeof(add));
+
+	/* older userspace sends the request without io geometry */
+	if (len < PXD_ADD_EXT_OUT_V1_SIZE) {
+		printk(KERN_ERR "%s: short request %u\n", __func__, size);
+		return -EINVAL;
+	}
 
+	memset(&add, 0, sizeof(add));
 	if (copy_from_iter(&add, len, iter) != len) {
 		printk(KERN_ERR "%s: can't copy arg\n", __func__);
 		return -EFAULT;
@@ -519,6 +532,32 @@ struct fuse_req* request_find_in_ctx(unsigned ctx, u64 unique)
 	return request_find(&pctx->fc, unique);
 }
 
+/* Finish a request on behalf of an io ring, the way a reply write does */
+int request_end_in_ctx(unsigned ctx, u64 unique, int status)
+{
+	struct pxd_context *pctx = find_context(ctx);
+	struct fuse_req *req;
+
+	if (!pctx)
+		return -ENOENT;
+
+	if (status <= -1000 || status > 0)
+		return -EINVAL;
+
+	req = request_find(&pctx->fc, unique);
+	if (!req) {
+		printk(KERN_ERR "%s: request %u:%lld not found\n", __func__, ctx, unique);
+		return -ENOENT;
+	}
+
+	/* read data of checksum devices is verified by the reply write only */
+	if (req->pxd_dev->checksum && req->in.opcode == PXD_READ && !status)
+		return -EOPNOTSUPP;
+
+	request_end(&pctx->fc, req, status);
+	return 0;
+}
+
 #define IOV_BUF_SIZE 64
 
 static int copy_in_read_data_iovec(struct iov_iter *iter,
@@ -544,10 +583,85 @@ static int copy_in_read_data_iovec(struct iov_iter *iter,
 	return 0;
 }
 
+/*
+ * Running crc32c over the blocks of a request on a checksum device. Writes
+ * store the checksum of each block in userspace, reads compare it with the
+ * checksum userspace sent after the data.
+ */
+struct fuse_csum {
+	struct pxd_device *pxd_dev;
+	u32 crc;			/* crc of the current block so far */
+	size_t len;			/* bytes of the current block seen */
+	u32 __user *out;		/* next checksum slot for writes */
+	struct iov_iter in;		/* expected checksums for reads */
+};
+
+static void fuse_csum_init(struct fuse_csum *cs, struct pxd_device *pxd_dev)
+{
+	cs->pxd_dev = pxd_dev;
+	cs->crc = ~0U;
+	cs->len = 0;
+	cs->out = NULL;
+}
+
+static int fuse_csum_block_end(struct fuse_csum *cs)
+{
+	u32 crc = ~cs->crc;
+	u32 expected;
+
+	cs->crc = ~0U;
+	cs->len = 0;
+
+	if (cs->out)
+		return put_user(crc, cs->out++) ? -EFAULT : 0;
+
+	if (copy_from_iter(&expected, sizeof(expected), &cs->in) !=
+	    sizeof(expected)) {
+		printk(KERN_ERR "%s: can't copy checksum\n", __func__);
+		return -EFAULT;
+	}
+	if (crc != expected) {
+		atomic64_inc(&cs->pxd_dev->nr_csum_errors);
+		printk_ratelimited(KERN_ERR "device %llu checksum mismatch "
+			"got %#x expected %#x\n", cs->pxd_dev->dev_id, crc,
+			expected);
+		return -EBADMSG;
+	}
+	return 0;
+}
+
+/* checksum data just copied to or from the page while it is cache hot */
+static int fuse_csum_page(struct fuse_csum *cs, struct page *page,
+		size_t offset, size_t len)
+{
+	char *kaddr;
+	size_t this;
+	int ret;
+
+	if (!cs)
+		return 0;
+
+	while (len) {
+		this = min_t(size_t, len, PXD_LBS - cs->len);
+		kaddr = kmap_atomic(page);
+		cs->crc = crc32c(cs->crc, kaddr + offset, this);
+		kunmap_atomic(kaddr);
+		cs->len += this;
+		offset += this;
+		len -= this;
+		if (cs->len == PXD_LBS) {
+			ret = fuse_csum_block_end(cs);
+			if (ret)
+				return ret;
+		}
+	}
+	return 0;
+}
+
 #ifndef __PXD_BIO_MAKEREQ__
 static int __fuse_notify_read_data(struct fuse_conn *conn,
-		struct fuse_req *req,
-		struct pxd_read_data_out *read_data_p, struct iov_iter *iter)
+		struct fuse_req *req, struct pxd_read_data_out *read_data_p,
+		struct fuse_csum *cs, struct iov_iter *iter)
 {
 	struct iovec iov[IOV_BUF_SIZE];
 	struct iov_iter data_iter;
@@ -582,28 +696,35 @@ static int __fuse_notify_read_data(struct fuse_conn *conn,
 			}
 		}
 		if (copied < len) {
-			size_t copy_this = copy_page_to_iter(BVEC(bvec).bv_page,
-				BVEC(bvec).bv_offset + copied,
-				len - copied, &data_iter);
-			if (copy_this != len - copied) {
+			struct page *page = BVEC(bvec).bv_page;
+			size_t offset = BVEC(bvec).bv_offset + copied;
+			size_t copy_this;
+
+			len -= copied;
+			copy_this = copy_page_to_iter(page, offset, len,
+				&data_iter);
+			if (copy_this != len) {
 				if (!iter->count)
-					return 0;
+					return fuse_csum_page(cs, page, offset,
+						copy_this);
 
 				/* out of space in destination, copy more iovec */
 				ret = copy_in_read_data_iovec(iter, read_data_p,
 					iov, &data_iter);
 				if (ret)
 					return ret;
-				len -= copied;
-				copied = copy_page_to_iter(BVEC(bvec).bv_page,
-					BVEC(bvec).bv_offset + copied + copy_this,
-					len, &data_iter);
-				if (copied != len) {
+				copied = copy_page_to_iter(page,
+					offset + copy_this,
+					len - copy_this, &data_iter);
+				if (copied != len - copy_this) {
 					printk(KERN_ERR "%s: copy failed new iovec\n",
 						__func__);
 					return -EFAULT;
 				}
 			}
+			ret = fuse_csum_page(cs, page, offset, len);
+			if (ret)
+				return ret;
 		}
 	}
 
@@ -611,8 +732,8 @@ static int __fuse_notify_read_data(struct fuse_conn *conn,
 }
 #else
 static int __fuse_notify_read_data(struct fuse_conn *conn,
-		struct fuse_req *req,
-		struct pxd_read_data_out *read_data_p, struct iov_iter *iter)
+		struct fuse_req *req, struct pxd_read_data_out *read_data_p,
+		struct fuse_csum *cs, struct iov_iter *iter)
 {
 	struct iovec iov[IOV_BUF_SIZE];
 	struct iov_iter data_iter;
@@ -648,28 +769,35 @@ static int __fuse_notify_read_data(struct fuse_conn *conn,
 			}
 		}
 		if (copied < len) {
-			size_t copy_this = copy_page_to_iter(BVEC(bvec).bv_page,
-				BVEC(bvec).bv_offset + copied,
-				len - copied, &data_iter);
-			if (copy_this != len - copied) {
+			struct page *page = BVEC(bvec).bv_page;
+			size_t offset = BVEC(bvec).bv_offset + copied;
+			size_t copy_this;
+
+			len -= copied;
+			copy_this = copy_page_to_iter(page, offset, len,
+				&data_iter);
+			if (copy_this != len) {
 				if (!iter->count)
-					return 0;
+					return fuse_csum_page(cs, page, offset,
+						copy_this);
 
 				/* out of space in destination, copy more iovec */
 				ret = copy_in_read_data_iovec(iter, read_data_p,
 					iov, &data_iter);
 				if (ret)
 					return ret;
-				len -= copied;
-				copied = copy_page_to_iter(BVEC(bvec).bv_page,
-					BVEC(bvec).bv_offset + copied + copy_this,
-					len, &data_iter);
-				if (copied != len) {
+				copied = copy_page_to_iter(page,
+					offset + copy_this,
+					len - copy_this, &data_iter);
+				if (copied != len - copy_this) {
 					printk(KERN_ERR "%s: copy failed new iovec\n",
 						__func__);
 					return -EFAULT;
 				}
 			}
+			ret = fuse_csum_page(cs, page, offset, len);
+			if (ret)
+				return ret;
 		}
 	}
 
@@ -682,6 +810,7 @@ static int fuse_notify_read_data(struct fuse_conn *conn, unsigned int size,
 {
 	struct pxd_read_data_out read_data;
 	size_t len = sizeof(read_data);
+	struct fuse_csum csum, *cs = NULL;
 	struct fuse_req *req;
 
 	if (copy_from_iter(&read_data, len, iter) != len) {
@@ -702,7 +831,26 @@ static int fuse_notify_read_data(struct fuse_conn *conn, unsigned int size,
 		return -EINVAL;
 	}
 
-	return __fuse_notify_read_data(conn, req, &read_data, iter);
+	if (req->pxd_dev->checksum) {
+		uint64_t addr;
+
+		len = sizeof(addr);
+		if (copy_from_iter(&addr, len, iter) != len) {
+			printk(KERN_ERR "%s: can't copy checksum arg\n",
+				__func__);
+			return -EFAULT;
+		}
+		if (read_data.offset & PXD_LBS_MASK) {
+			printk(KERN_ERR "%s: unaligned offset %u\n", __func__,
+				read_data.offset);
+			return -EINVAL;
+		}
+		fuse_csum_init(&csum, req->pxd_dev);
+		csum.out = (u32 __user *)(uintptr_t)addr;
+		cs = &csum;
+	}
+
+	return __fuse_notify_read_data(conn, req, &read_data, cs, iter);
 }
 
 
@@ -814,6 +962,35 @@ static int fuse_notify_export(struct fuse_conn *conn, unsigned int size,
 	return pxd_export(conn, dev_id);
 }
 
+static int fuse_notify_batch(struct fuse_conn *conn, unsigned int size,
+		struct iov_iter *iter)
+{
+	struct pxd_batch_out batch;
+	size_t len = sizeof(batch);
+
+	if (copy_from_iter(&batch, len, iter) != len) {
+		printk(KERN_ERR "%s: can't copy arg\n", __func__);
+		return -EFAULT;
+	}
+
+	/* entries older than io geometry or newer than the driver are refused */
+	if (batch.entry_size < PXD_ADD_EXT_OUT_V1_SIZE ||
+	    batch.entry_size > sizeof(struct pxd_add_ext_out)) {
+		printk(KERN_ERR "%s: unsupported entry size %u\n", __func__,
+			batch.entry_size);
+		return -EINVAL;
+	}
+
+	if (!batch.count || batch.count > PXD_MAX_DEVICES ||
+	    size != len + batch.count * batch.entry_size) {
+		printk(KERN_ERR "%s: invalid batch count %u size %u\n", __func__,
+			batch.count, size);
+		return -EINVAL;
+	}
+
+	return pxd_batch(conn, &batch, iter);
+}
+
 static int fuse_notify(struct fuse_conn *fc, enum fuse_notify_code code,
 		       unsigned int size, struct iov_iter *iter)
 {
@@ -840,11 +1017,31 @@ static int fuse_notify(struct fuse_conn *fc, enum fuse_notify_code code,
 		return fuse_notify_ioswitch_event(fc, size, iter, false);
 	case PXD_EXPORT_DEV:
 		return fuse_notify_export(fc, size, iter);
+	case PXD_BATCH:
+		return fuse_notify_batch(fc, size, iter);
 	default:
 		return -EINVAL;
 	}
 }
 
+/* checksums of a read reply follow the data, one for each block */
+static int fuse_csum_read_init(struct fuse_csum *cs, struct fuse_req *req,
+		struct iov_iter *iter)
+{
+	size_t size = req->pxd_rdwr_in.size;
+
+	if (iter->count != size + size / PXD_LBS * sizeof(u32)) {
+		printk(KERN_ERR "%s: bad reply size %zu for %zu bytes\n",
+			__func__, iter->count, size);
+		return -EINVAL;
+	}
+
+	fuse_csum_init(cs, req->pxd_dev);
+	cs->in = *iter;
+	iov_iter_advance(&cs->in, size);
+	return 0;
+}
+
 /*
  * Write a single reply to a request.  First the header is copied from
  * the write buffer.  The request is then searched on the processing
@@ -865,6 +1062,15 @@ static int __fuse_dev_do_write(struct fuse_conn *fc,
 		struct request *breq = req->rq;
 		struct req_iterator breq_iter;
 		int nsegs = breq->nr_phys_segments;
+		struct fuse_csum csum, *cs = NULL;
+		int ret;
+
+		if (req->pxd_dev->checksum) {
+			ret = fuse_csum_read_init(&csum, req, iter);
+			if (ret)
+				return ret;
+			cs = &csum;
+		}
 
 		if (nsegs) {
 			int i = 0;
@@ -877,6 +1083,10 @@ static int __fuse_dev_do_write(struct fuse_conn *fc,
 					       __func__, i, nsegs);
 					return -EFAULT;
 				}
+				ret = fuse_csum_page(cs, BVEC(bvec).bv_page,
+						     BVEC(bvec).bv_offset, len);
+				if (ret)
+					return ret;
 				i++;
 			}
 		}
@@ -898,8 +1108,17 @@ static int __fuse_dev_do_write(struct fuse_conn *fc,
 	int nsegs = bio_segments(breq);
 	int bvec_iter;
 #endif
+	struct fuse_csum csum, *cs = NULL;
+	int ret;
 
 	if (req->in.opcode == PXD_READ && iter->count > 0) {
+		if (req->pxd_dev->checksum) {
+			ret = fuse_csum_read_init(&csum, req, iter);
+			if (ret)
+				return ret;
+			cs = &csum;
+		}
+
 		if (nsegs) {
 			int i = 0;
 			bio_for_each_segment(bvec, breq, bvec_iter) {
@@ -911,6 +1130,10 @@ static int __fuse_dev_do_write(struct fuse_conn *fc,
 					       __func__, i, nsegs);
 					return -EFAULT;
 				}
+				ret = fuse_csum_page(cs, BVEC(bvec).bv_page,
+						     BVEC(bvec).bv_offset, len);
+				if (ret)
+					return ret;
 				i++;
 			}
 		}
@@ -958,6 +1181,11 @@ static ssize_t fuse_dev_do_write(struct fuse_conn *fc, struct iov_iter *iter)
 	}
 
 	err = __fuse_dev_do_write(fc, req, iter);
+	if (err == -EBADMSG) {
+		/* data failed checksum verification, fail the io */
+		request_end(fc, req, -EIO);
+		return nbytes;
+	}
 	if (err)
 		return err;
 
@@ -133,7 +133,12 @@ struct ____cacheline_aligned fuse_queue_writer {
 	spinlock_t lock;	/** writer lock */
 	uint32_t need_wake_up; /** if true reader needs wake up call */
 	uint64_t sequence;        /** next request sequence number */
-	uint64_t pad[5];
+	uint64_t pad_0;
+	uint32_t cq_flags;	/** IORING_CQ_* flags, completion queue only */
+	uint32_t cq_overflow;	/** completions that went to the backlog */
+	uint32_t cq_user_flags;	/** IORING_CQ_USER_* flags, set by userspace */
+	uint32_t pad_1;
+	uint64_t pad[2];
 };
 
 /** reader control block */
@@ -161,7 +166,10 @@ struct alignas(64) fuse_queue_writer {
 	uint32_t committed_;    /** last write index committed to reader */
 	bool in_runq;			/** a thread is processing the queue */
 	char pad_1[3];
-	uint32_t pad_2[8];
+	uint32_t cq_flags;		/** IORING_CQ_* flags, completion queue only */
+	uint32_t cq_overflow;		/** completions that went to the backlog */
+	uint32_t cq_user_flags;		/** IORING_CQ_USER_* flags, set by userspace */
+	uint32_t pad_2[5];
 };
 
 /** reader control block */
@@ -326,6 +334,8 @@ int fuse_restart_requests(struct fuse_conn *fc);
 ssize_t pxd_add(struct fuse_conn *fc, struct pxd_add_ext_out *add);
 ssize_t pxd_export(struct fuse_conn *fc, uint64_t dev_id);
 ssize_t pxd_remove(struct fuse_conn *fc, struct pxd_remove_out *remove);
+ssize_t pxd_batch(struct fuse_conn *fc, struct pxd_batch_out *batch,
+		struct iov_iter *iter);
 ssize_t pxd_update_size(struct fuse_conn *fc, struct pxd_update_size *update_size);
 ssize_t pxd_ioc_update_size(struct fuse_conn *fc, struct pxd_update_size *update_size);
 ssize_t pxd_read_init(struct fuse_conn *fc, struct iov_iter *iter);
@@ -337,6 +347,7 @@ void fuse_convert_zero_writes(struct fuse_req *req);
 void fuse_queue_init_cb(struct fuse_queue_cb *cb);
 
 struct fuse_req* request_find_in_ctx(unsigned ctx, u64 unique);
+int request_end_in_ctx(unsigned ctx, u64 unique, int status);
 
 // request lookups.
 struct fuse_req *request_find(struct fuse_conn *fc, u64 unique);
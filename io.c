@@ -67,6 +67,7 @@
 #include <net/af_unix.h>
 #include <net/scm.h>
 #include <linux/anon_inodes.h>
+#include <linux/eventfd.h>
 #include <linux/sched/mm.h>
 #include <linux/uaccess.h>
 #include <linux/nospec.h>
@@ -205,6 +206,7 @@ struct io_cq_ring {
 
 struct io_submit_state {
 	struct blk_plug		plug;
+	struct io_ring_ctx	*ctx;
 
 	/*
 	 * io_kiocb alloc cache
@@ -227,6 +229,125 @@ static void io_sq_wq_submit_work(struct work_struct *work);
 
 struct kmem_cache *req_cachep;
 
+/*
+ * Freed requests are kept on a per context list instead of going back to
+ * the slab one by one, often from another cpu, and submission takes them
+ * back a batch at a time. The list is capped, and a shrinker trims it,
+ * starting with contexts that did not draw from it since the last pass.
+ */
+#define IO_REQ_CACHE_MAX	512
+
+static LIST_HEAD(io_ctx_list);
+static DEFINE_SPINLOCK(io_ctx_list_lock);
+
+static unsigned io_req_cache_get(struct io_ring_ctx *ctx, void **reqs,
+				 unsigned nr)
+{
+	unsigned long flags;
+	unsigned i;
+
+	if (!READ_ONCE(ctx->req_cache_nr))
+		return 0;
+
+	spin_lock_irqsave(&ctx->req_cache_lock, flags);
+	for (i = 0; i < nr && !list_empty(&ctx->req_cache); i++) {
+		struct io_kiocb *req;
+
+		req = list_first_entry(&ctx->req_cache, struct io_kiocb, list);
+		list_del(&req->list);
+		reqs[i] = req;
+	}
+	ctx->req_cache_nr -= i;
+	ctx->req_cache_active = true;
+	spin_unlock_irqrestore(&ctx->req_cache_lock, flags);
+
+	return i;
+}
+
+static void io_req_cache_put(struct io_ring_ctx *ctx, struct io_kiocb *req)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&ctx->req_cache_lock, flags);
+	if (ctx->req_cache_nr < IO_REQ_CACHE_MAX) {
+		list_add(&req->list, &ctx->req_cache);
+		ctx->req_cache_nr++;
+		req = NULL;
+	}
+	spin_unlock_irqrestore(&ctx->req_cache_lock, flags);
+
+	if (req)
+		kmem_cache_free(req_cachep, req);
+}
+
+/* free up to @nr cached requests, coldest first */
+static unsigned long io_req_cache_trim(struct io_ring_ctx *ctx,
+				       unsigned long nr)
+{
+	struct io_kiocb *req, *tmp;
+	unsigned long flags, freed = 0;
+	LIST_HEAD(list);
+
+	spin_lock_irqsave(&ctx->req_cache_lock, flags);
+	while (freed < nr && !list_empty(&ctx->req_cache)) {
+		req = list_last_entry(&ctx->req_cache, struct io_kiocb, list);
+		list_move(&req->list, &list);
+		freed++;
+	}
+	ctx->req_cache_nr -= freed;
+	spin_unlock_irqrestore(&ctx->req_cache_lock, flags);
+
+	list_for_each_entry_safe(req, tmp, &list, list)
+		kmem_cache_free(req_cachep, req);
+
+	return freed;
+}
+
+static unsigned long io_req_cache_count(struct shrinker *shrink,
+					struct shrink_control *sc)
+{
+	struct io_ring_ctx *ctx;
+	unsigned long count = 0;
+
+	spin_lock(&io_ctx_list_lock);
+	list_for_each_entry(ctx, &io_ctx_list, ctx_list)
+		count += READ_ONCE(ctx->req_cache_nr);
+	spin_unlock(&io_ctx_list_lock);
+
+	return count;
+}
+
+static unsigned long io_req_cache_scan(struct shrinker *shrink,
+				       struct shrink_control *sc)
+{
+	struct io_ring_ctx *ctx;
+	unsigned long freed = 0;
+	int pass;
+
+	spin_lock(&io_ctx_list_lock);
+	/* idle contexts first, then everybody */
+	for (pass = 0; pass < 2 && freed < sc->nr_to_scan; pass++) {
+		list_for_each_entry(ctx, &io_ctx_list, ctx_list) {
+			if (!pass && READ_ONCE(ctx->req_cache_active)) {
+				WRITE_ONCE(ctx->req_cache_active, false);
+				continue;
+			}
+			freed += io_req_cache_trim(ctx, sc->nr_to_scan - freed);
+			if (freed >= sc->nr_to_scan)
+				break;
+		}
+	}
+	spin_unlock(&io_ctx_list_lock);
+
+	return freed ? freed : SHRINK_STOP;
+}
+
+static struct shrinker io_req_shrinker = {
+	.count_objects	= io_req_cache_count,
+	.scan_objects	= io_req_cache_scan,
+	.seeks		= DEFAULT_SEEKS,
+};
+
 static void *io_alloc_msg_buf(struct io_ring_ctx *ctx)
 {
 	if (ctx->nr_msg_bufs == 0) {
@@ -250,10 +371,9 @@ static size_t queue_size(struct io_ring_ctx *ctx)
 			ctx->cq_entries * sizeof(struct io_uring_cqe);
 }
 
+/* ctx was zeroed by io_uring_open() and is initialised once */
 static int io_ring_ctx_init(struct io_ring_ctx *ctx, struct io_uring_params *params)
 {
-	memset(ctx, 0, sizeof(*ctx));
-
 	ctx->flags = params->flags;
 	ctx->sq_thread_idle = params->sq_thread_idle;
 
@@ -296,30 +416,58 @@ static int io_ring_ctx_init(struct io_ring_ctx *ctx, struct io_uring_params *par
 		return -ENOMEM;
 	}
 	ctx->nr_user_files = IORING_MAX_FIXED_FILES;
+	ctx->file_bitmap = kcalloc(BITS_TO_LONGS(IORING_MAX_FIXED_FILES),
+				   sizeof(unsigned long), GFP_KERNEL);
+	if (ctx->file_bitmap == NULL) {
+		vfree(ctx->queue);
+		kfree(ctx->user_files);
+		return -ENOMEM;
+	}
 
 	ctx->nr_msg_bufs = 0;
 	ctx->msg_bufs = kcalloc(PXD_IO_MAX_MSG_BUFS, sizeof(void *), GFP_KERNEL);
 	if (ctx->msg_bufs == NULL) {
 		vfree(ctx->queue);
 		kfree(ctx->user_files);
+		kfree(ctx->file_bitmap);
+	}
+
+	if (io_cq_stage_init(ctx)) {
+		vfree(ctx->queue);
+		kfree(ctx->user_files);
+		kfree(ctx->file_bitmap);
+		kfree(ctx->msg_bufs);
+		return -ENOMEM;
 	}
 
 	if (percpu_ref_init(&ctx->refs, io_ring_ctx_ref_free, 0, GFP_KERNEL)) {
 		vfree(ctx->queue);
 		kfree(ctx->user_files);
+		kfree(ctx->file_bitmap);
 		kfree(ctx->msg_bufs);
+		free_percpu(ctx->cq_stage);
 		return -ENOMEM;
 	}
 
 	init_waitqueue_head(&ctx->wait);
 	init_completion(&ctx->ctx_done);
 	mutex_init(&ctx->uring_lock);
+	mutex_init(&ctx->ubuf_lock);
 	init_waitqueue_head(&ctx->cq_wait);
 	spin_lock_init(&ctx->completion_lock);
+	spin_lock_init(&ctx->sq_lock);
 	INIT_LIST_HEAD(&ctx->poll_list);
 	INIT_LIST_HEAD(&ctx->cancel_list);
 	INIT_LIST_HEAD(&ctx->defer_list);
+	INIT_LIST_HEAD(&ctx->cq_overflow_list);
 	INIT_LIST_HEAD(&ctx->sock_poll_list);
+	INIT_LIST_HEAD(&ctx->timeout_list);
+	spin_lock_init(&ctx->req_cache_lock);
+	INIT_LIST_HEAD(&ctx->req_cache);
+
+	spin_lock(&io_ctx_list_lock);
+	list_add(&ctx->ctx_list, &io_ctx_list);
+	spin_unlock(&io_ctx_list_lock);
 
 	return 0;
 }
@@ -349,6 +497,173 @@ static struct io_kiocb *io_get_deferred_req(struct io_ring_ctx *ctx)
 	return NULL;
 }
 
+/* caller holds rcu_read_lock() or ->ubuf_lock */
+static struct io_mapped_ubuf *io_ubuf_lookup(struct io_ring_ctx *ctx,
+					     unsigned index)
+{
+	struct io_mapped_ubuf __rcu **table = smp_load_acquire(&ctx->user_bufs);
+
+	if (!table || index >= PXD_IO_MAX_USER_BUFS)
+		return NULL;
+	index = array_index_nospec(index, PXD_IO_MAX_USER_BUFS);
+	return rcu_dereference_check(table[index],
+				     lockdep_is_held(&ctx->ubuf_lock));
+}
+
+static void io_ubuf_free(struct io_mapped_ubuf *imu)
+{
+	unsigned i;
+
+	for (i = 0; i < imu->nr_bvecs; i++)
+		if (imu->bvec[i].bv_page)
+			put_page(imu->bvec[i].bv_page);
+
+	kvfree(imu->segs);
+	kvfree(imu->seg_start);
+	kvfree(imu->bvec);
+	kfree(imu);
+}
+
+static void io_ubuf_free_work(struct work_struct *work)
+{
+	io_ubuf_free(container_of(work, struct io_mapped_ubuf, free_work));
+}
+
+/*
+ * Drop a request's reference. The slot was cleared and a grace period has
+ * passed before the table dropped its own, so the last put can free right
+ * away, but unpinning a large region doesn't belong in completion context.
+ */
+static void io_ubuf_put(struct io_ring_ctx *ctx, struct io_mapped_ubuf *imu)
+{
+	if (refcount_dec_and_test(&imu->refs))
+		queue_work(ctx->io_wq[IO_WQ_BOUND], &imu->free_work);
+}
+
+/* block and file IO is bounded, anything that may wait on the network isn't */
+static bool io_req_bound_work(struct io_kiocb *req)
+{
+	switch (READ_ONCE(req->submit.sqe->opcode)) {
+	case IORING_OP_READV:
+	case IORING_OP_WRITEV:
+	case IORING_OP_READ_FIXED:
+	case IORING_OP_WRITE_FIXED:
+	case IORING_OP_FSYNC:
+	case IORING_OP_SYNC_FILE_RANGE:
+	case IORING_OP_READ_BIO:
+	case IORING_OP_WRITE_BIO:
+	case IORING_OP_DISCARD_FIXED:
+	case IORING_OP_SYNCFS_FIXED:
+	case IORING_OP_COPY_DATA:
+	case IORING_OP_REQ_DONE:
+		return true;
+	default:
+		return false;
+	}
+}
+
+/*
+ * Node the work should run on: the one holding the fixed buffer it copies
+ * to or from, else the one the backing device is attached to.
+ */
+static int io_req_work_node(struct io_ring_ctx *ctx, struct io_kiocb *req,
+			    bool bound)
+{
+	struct block_device *bdev;
+	struct inode *inode;
+
+	if (!bound)
+		return NUMA_NO_NODE;
+
+	switch (READ_ONCE(req->submit.sqe->opcode)) {
+	case IORING_OP_READ_FIXED:
+	case IORING_OP_WRITE_FIXED:
+	case IORING_OP_COPY_DATA: {
+		struct io_mapped_ubuf *imu;
+		int node = NUMA_NO_NODE;
+
+		rcu_read_lock();
+		imu = io_ubuf_lookup(ctx, READ_ONCE(req->submit.sqe->buf_index));
+		if (imu && imu->bvec[0].bv_page)
+			node = page_to_nid(imu->bvec[0].bv_page);
+		rcu_read_unlock();
+		if (node != NUMA_NO_NODE)
+			return node;
+		break;
+	}
+	}
+
+	if (!req->file)
+		return NUMA_NO_NODE;
+
+	inode = file_inode(req->file);
+	bdev = S_ISBLK(inode->i_mode) ? I_BDEV(inode) : inode->i_sb->s_bdev;
+	if (!bdev || !bdev->bd_disk)
+		return NUMA_NO_NODE;
+	return bdev->bd_disk->node_id;
+}
+
+static void io_queue_async_work(struct io_ring_ctx *ctx, struct io_kiocb *req,
+				bool bound)
+{
+	struct io_wq_stats *stats;
+	int node;
+
+	req->wq_class = bound ? IO_WQ_BOUND : IO_WQ_UNBOUND;
+	stats = &ctx->wq_stats[req->wq_class];
+	atomic_inc(&stats->pending);
+	atomic64_inc(&stats->queued);
+	req->work_queued_ns = ktime_get_ns();
+
+	node = io_req_work_node(ctx, req, bound);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,0,0)
+	if (node != NUMA_NO_NODE) {
+		queue_work_node(node, ctx->io_wq[req->wq_class], &req->work);
+		return;
+	}
+#endif
+	queue_work(ctx->io_wq[req->wq_class], &req->work);
+}
+
+/* called first thing by every work function queued above */
+static void io_async_work_start(struct io_kiocb *req)
+{
+	struct io_wq_stats *stats = &req->ctx->wq_stats[req->wq_class];
+
+	atomic_dec(&stats->pending);
+	atomic64_add(ktime_get_ns() - req->work_queued_ns, &stats->wait_ns);
+}
+
+/*
+ * Signal the registered eventfd, once per tail update however many events
+ * it publishes. Userspace turns it off while it is draining the ring anyway.
+ * An eventfd wakeup that completes a poll on the same eventfd recurses here;
+ * the eventfd is being signalled already, so that one is skipped.
+ */
+static void io_cqring_ev_posted(struct io_ring_ctx *ctx)
+{
+	struct fuse_queue_cb *cb = ctx->responses_cb;
+
+	if (!ctx->cq_ev_fd)
+		return;
+	if (READ_ONCE(cb->w.cq_user_flags) & IORING_CQ_USER_EVENTFD_DISABLED)
+		return;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,15,0)
+	if (!eventfd_signal_allowed())
+		return;
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(5,2,0)
+	if (eventfd_signal_count())
+		return;
+#endif
+
+	ctx->cq_ev_signals++;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,8,0)
+	eventfd_signal(ctx->cq_ev_fd);
+#else
+	eventfd_signal(ctx->cq_ev_fd, 1);
+#endif
+}
+
 static void __io_commit_cqring(struct io_ring_ctx *ctx)
 {
 	struct fuse_queue_cb *cb = ctx->responses_cb;
@@ -357,10 +672,13 @@ static void __io_commit_cqring(struct io_ring_ctx *ctx)
 		/* order cqe stores with ring update */
 		smp_store_release(&cb->r.write, ctx->cached_cq_tail);
 
+		ctx->cq_flushes++;
 		if (wq_has_sleeper(&ctx->cq_wait)) {
+			ctx->cq_wakeups++;
 			wake_up_interruptible(&ctx->cq_wait);
 			kill_fasync(&ctx->cq_fasync, SIGIO, POLL_IN);
 		}
+		io_cqring_ev_posted(ctx);
 	}
 }
 
@@ -372,7 +690,7 @@ static void io_commit_cqring(struct io_ring_ctx *ctx)
 
 	while ((req = io_get_deferred_req(ctx)) != NULL) {
 		req->flags |= REQ_F_IO_DRAINED;
-		queue_work(ctx->sqo_wq, &req->work);
+		io_queue_async_work(ctx, req, io_req_bound_work(req));
 	}
 }
 
@@ -395,147 +713,651 @@ static struct io_uring_cqe *io_get_cqring(struct io_ring_ctx *ctx)
 	return &ctx->responses[tail & ctx->cq_mask];
 }
 
-static void io_cqring_fill_event(struct io_ring_ctx *ctx, u64 ki_user_data,
-				 long res)
-{
-	struct io_uring_cqe *cqe;
-
-	cqe = io_get_cqring(ctx);
-	BUG_ON(!cqe);
-	WRITE_ONCE(cqe->user_data, ki_user_data);
-	WRITE_ONCE(cqe->res, res);
-	WRITE_ONCE(cqe->flags, 0);
-}
-
-static void io_cqring_add_event(struct io_ring_ctx *ctx, u64 user_data,
-				long res)
+/*
+ * The ring is full, keep the completion on the backlog until the consumer
+ * makes room. Called with cb->w.lock held.
+ */
+static void io_cqring_overflow(struct io_ring_ctx *ctx, u64 ki_user_data,
+			       long res, unsigned cflags)
 {
 	struct fuse_queue_cb *cb = ctx->responses_cb;
+	struct io_overflow_cqe *ocqe;
 
-	unsigned long flags;
+	WRITE_ONCE(cb->w.cq_overflow, cb->w.cq_overflow + 1);
 
-	spin_lock_irqsave(&cb->w.lock, flags);
-	io_cqring_fill_event(ctx, user_data, res);
-	io_commit_cqring(ctx);
-	spin_unlock_irqrestore(&cb->w.lock, flags);
+	ocqe = kmalloc(sizeof(*ocqe), GFP_ATOMIC | __GFP_NOWARN);
+	if (!ocqe) {
+		ctx->cq_dropped++;
+		pr_err_ratelimited("%s: dropped completion %llu res %ld",
+				   __func__, ki_user_data, res);
+		return;
+	}
+
+	ocqe->cqe.user_data = ki_user_data;
+	ocqe->cqe.res = res;
+	ocqe->cqe.flags = cflags;
+	list_add_tail(&ocqe->list, &ctx->cq_overflow_list);
+	if (!ctx->cq_backlog++)
+		WRITE_ONCE(cb->w.cq_flags, cb->w.cq_flags | IORING_CQ_OVERFLOW);
 }
 
-static void io_ring_drop_ctx_refs(struct io_ring_ctx *ctx, unsigned refs)
+/* stop taking new work once the backlog is as deep as the ring */
+static bool io_cqring_backlog_full(struct io_ring_ctx *ctx)
 {
-	percpu_ref_put_many(&ctx->refs, refs);
-
-	if (waitqueue_active(&ctx->wait))
-		wake_up(&ctx->wait);
+	return READ_ONCE(ctx->cq_backlog) >= ctx->cq_entries;
 }
 
-static struct io_kiocb *io_get_req(struct io_ring_ctx *ctx,
-				   struct io_submit_state *state)
+/* move backlogged completions to the ring, called with cb->w.lock held */
+static void io_cqring_overflow_flush(struct io_ring_ctx *ctx)
 {
-	gfp_t gfp = GFP_KERNEL | __GFP_NOWARN;
-	struct io_kiocb *req;
-
-	if (!percpu_ref_tryget(&ctx->refs))
-		return NULL;
+	struct fuse_queue_cb *cb = ctx->responses_cb;
+	struct io_overflow_cqe *ocqe;
+	struct io_uring_cqe *cqe;
+	struct io_sq_data *sqd;
+	bool was_full = io_cqring_backlog_full(ctx);
 
-	if (!state) {
-		req = kmem_cache_alloc(req_cachep, gfp);
-		if (unlikely(!req))
+	while (!list_empty(&ctx->cq_overflow_list)) {
+		cqe = io_get_cqring(ctx);
+		if (!cqe)
 			goto out;
-	} else if (!state->free_reqs) {
-		size_t sz;
-		int ret;
-
-		sz = min_t(size_t, state->ios_left, ARRAY_SIZE(state->reqs));
-		ret = kmem_cache_alloc_bulk(req_cachep, gfp, sz, state->reqs);
 
-		/*
-		 * Bulk alloc is all-or-nothing. If we fail to get a batch,
-		 * retry single alloc to be on the safe side.
-		 */
-		if (unlikely(ret <= 0)) {
-			state->reqs[0] = kmem_cache_alloc(req_cachep, gfp);
-			if (!state->reqs[0])
-				goto out;
-			ret = 1;
-		}
-		state->free_reqs = ret - 1;
-		state->cur_req = 1;
-		req = state->reqs[0];
-	} else {
-		req = state->reqs[state->cur_req];
-		state->free_reqs--;
-		state->cur_req++;
+		ocqe = list_first_entry(&ctx->cq_overflow_list,
+					struct io_overflow_cqe, list);
+		list_del(&ocqe->list);
+		WRITE_ONCE(cqe->user_data, ocqe->cqe.user_data);
+		WRITE_ONCE(cqe->res, ocqe->cqe.res);
+		WRITE_ONCE(cqe->flags, ocqe->cqe.flags);
+		kfree(ocqe);
+		ctx->cq_backlog--;
 	}
 
-	req->file = NULL;
-	req->ctx = ctx;
-	req->flags = 0;
-	/* one is dropped after submission, the other at completion */
-	refcount_set(&req->refs, 2);
-	return req;
+	WRITE_ONCE(cb->w.cq_flags, cb->w.cq_flags & ~IORING_CQ_OVERFLOW);
 out:
-	io_ring_drop_ctx_refs(ctx, 1);
-	return NULL;
+	/*
+	 * SQ threads go idle while the backlog is full, restart them. The
+	 * ring is only detached from them once the flush tasklets are dead.
+	 */
+	sqd = READ_ONCE(ctx->sq_data);
+	if (was_full && !io_cqring_backlog_full(ctx) && sqd)
+		wake_up(&sqd->wait);
 }
 
-static void io_free_req(struct io_kiocb *req)
+static void io_cqring_fill_event(struct io_ring_ctx *ctx, u64 ki_user_data,
+				 long res, unsigned cflags)
 {
-	if (req->file && !(req->flags & REQ_F_FIXED_FILE))
-		fput(req->file);
-	io_ring_drop_ctx_refs(req->ctx, 1);
-	kmem_cache_free(req_cachep, req);
+	struct io_uring_cqe *cqe;
+
+	/* nothing overtakes the backlog, completions stay in order */
+	cqe = ctx->cq_backlog ? NULL : io_get_cqring(ctx);
+	if (unlikely(!cqe)) {
+		io_cqring_overflow(ctx, ki_user_data, res, cflags);
+		return;
+	}
+	WRITE_ONCE(cqe->user_data, ki_user_data);
+	WRITE_ONCE(cqe->res, res);
+	WRITE_ONCE(cqe->flags, cflags);
 }
 
-static void io_put_req(struct io_kiocb *req)
+/* move all staged completions to the CQ ring, called with cb->w.lock held */
+static void io_cqring_flush_stage(struct io_ring_ctx *ctx)
 {
-	if (refcount_dec_and_test(&req->refs))
-		io_free_req(req);
+	int cpu, i;
+
+	if (unlikely(ctx->cq_backlog))
+		io_cqring_overflow_flush(ctx);
+
+	for_each_cpu(cpu, &ctx->cq_stage_mask) {
+		struct io_cq_stage *st = per_cpu_ptr(ctx->cq_stage, cpu);
+
+		cpumask_clear_cpu(cpu, &ctx->cq_stage_mask);
+		spin_lock(&st->lock);
+		for (i = 0; i < st->nr; i++)
+			io_cqring_fill_event(ctx, st->cqes[i].user_data,
+				st->cqes[i].res, st->cqes[i].flags);
+		ctx->cq_events += st->nr;
+		st->nr = 0;
+		spin_unlock(&st->lock);
+	}
 }
 
-static void kiocb_end_write(struct kiocb *kiocb)
+/*
+ * Whoever gets the CQ ring lock flushes every cpu's stage. Contexts that
+ * find the lock taken leave their entries for the holder, which rechecks
+ * cq_flush_pending after unlocking, so no entry is left behind and nobody
+ * spins on the ring lock. Called with irqs disabled.
+ */
+static void io_cqring_flush_pending(struct io_ring_ctx *ctx)
 {
-	if (kiocb->ki_flags & IOCB_WRITE) {
-		struct inode *inode = file_inode(kiocb->ki_filp);
+	struct fuse_queue_cb *cb = ctx->responses_cb;
 
-		/*
-		 * Tell lockdep we inherited freeze protection from submission
-		 * thread.
-		 */
-		if (S_ISREG(inode->i_mode))
-			__sb_writers_acquired(inode->i_sb, SB_FREEZE_WRITE);
-		file_end_write(kiocb->ki_filp);
+	atomic_set(&ctx->cq_flush_pending, 1);
+	smp_mb__after_atomic();
+	while (atomic_read(&ctx->cq_flush_pending) &&
+	       spin_trylock(&cb->w.lock)) {
+		atomic_set(&ctx->cq_flush_pending, 0);
+		smp_mb__after_atomic();
+		io_cqring_flush_stage(ctx);
+		io_commit_cqring(ctx);
+		spin_unlock(&cb->w.lock);
+		/* pairs with the barrier after setting cq_flush_pending */
+		smp_mb();
 	}
 }
 
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,16,0)
-static void io_complete_rw(struct kiocb *kiocb, long res)
-#else
-static void io_complete_rw(struct kiocb *kiocb, long res, long res2)
-#endif
+/* runs after the softirq batch or hardirq that staged completions */
+static void io_cq_stage_flush_fn(unsigned long data)
 {
-	struct io_kiocb *req = container_of(kiocb, struct io_kiocb, rw);
-
-	kiocb_end_write(kiocb);
+	struct io_ring_ctx *ctx = (struct io_ring_ctx *) data;
+	unsigned long flags;
 
-	io_cqring_add_event(req->ctx, req->user_data, res);
-	io_put_req(req);
+	local_irq_save(flags);
+	io_cqring_flush_pending(ctx);
+	local_irq_restore(flags);
 }
 
 /*
- * If we tracked the file through the SCM inflight mechanism, we could support
- * any file. For now, just ensure that anything potentially problematic is done
- * inline.
+ * Completions are staged on the local cpu. Backing device completions come
+ * in bursts from irq and softirq context, those only schedule the stage's
+ * tasklet so the whole burst is published with one tail update and one
+ * wakeup. Process context flushes right away.
  */
-static bool io_file_supports_async(struct file *file)
+static void __io_cqring_add_event(struct io_ring_ctx *ctx, u64 user_data,
+				  long res, unsigned cflags)
 {
-	umode_t mode = file_inode(file)->i_mode;
+	struct fuse_queue_cb *cb = ctx->responses_cb;
+	struct io_cq_stage *st;
+	unsigned long flags;
 
-	if (S_ISBLK(mode) || S_ISCHR(mode))
-		return true;
-	if (S_ISREG(mode) && file->f_op != &fuse_dev_operations)
-		return true;
+	local_irq_save(flags);
+	st = this_cpu_ptr(ctx->cq_stage);
+	spin_lock(&st->lock);
+	if (unlikely(st->nr == IO_CQ_STAGE_ENTRIES)) {
+		/* stage full, make room under the ring lock */
+		spin_unlock(&st->lock);
+		spin_lock(&cb->w.lock);
+		io_cqring_flush_stage(ctx);
+		io_commit_cqring(ctx);
+		spin_unlock(&cb->w.lock);
+		spin_lock(&st->lock);
+	}
+	st->cqes[st->nr].user_data = user_data;
+	st->cqes[st->nr].res = res;
+	st->cqes[st->nr].flags = cflags;
+	st->nr++;
+	spin_unlock(&st->lock);
+	cpumask_set_cpu(smp_processor_id(), &ctx->cq_stage_mask);
+
+	if (in_interrupt())
+		tasklet_schedule(&st->flush);
+	else
+		io_cqring_flush_pending(ctx);
+	local_irq_restore(flags);
+}
 
-	return false;
+static void io_cqring_add_event(struct io_ring_ctx *ctx, u64 user_data,
+				long res)
+{
+	__io_cqring_add_event(ctx, user_data, res, 0);
+}
+
+/*
+ * The consumer only tells us it made room by moving the head, so the
+ * backlog is retried from the submission paths and poll.
+ */
+static void io_cqring_overflow_kick(struct io_ring_ctx *ctx)
+{
+	struct fuse_queue_cb *cb = ctx->responses_cb;
+	unsigned long flags;
+
+	if (likely(!READ_ONCE(ctx->cq_backlog)))
+		return;
+
+	spin_lock_irqsave(&cb->w.lock, flags);
+	io_cqring_flush_stage(ctx);
+	io_commit_cqring(ctx);
+	spin_unlock_irqrestore(&cb->w.lock, flags);
+}
+
+static void io_cqring_overflow_free(struct io_ring_ctx *ctx)
+{
+	struct io_overflow_cqe *ocqe, *tmp;
+
+	if (!ctx->cq_backlog)
+		return;
+
+	list_for_each_entry_safe(ocqe, tmp, &ctx->cq_overflow_list, list)
+		kfree(ocqe);
+	INIT_LIST_HEAD(&ctx->cq_overflow_list);
+	ctx->cq_backlog = 0;
+}
+
+static int io_cq_stage_init(struct io_ring_ctx *ctx)
+{
+	int cpu;
+
+	ctx->cq_stage = alloc_percpu(struct io_cq_stage);
+	if (!ctx->cq_stage)
+		return -ENOMEM;
+
+	for_each_possible_cpu(cpu) {
+		struct io_cq_stage *st = per_cpu_ptr(ctx->cq_stage, cpu);
+
+		spin_lock_init(&st->lock);
+		st->nr = 0;
+		tasklet_init(&st->flush, io_cq_stage_flush_fn,
+			     (unsigned long) ctx);
+	}
+	cpumask_clear(&ctx->cq_stage_mask);
+	atomic_set(&ctx->cq_flush_pending, 0);
+	return 0;
+}
+
+/* wait for scheduled flushes, they write the CQ ring */
+static void io_cq_stage_stop(struct io_ring_ctx *ctx)
+{
+	int cpu;
+
+	if (!ctx->cq_stage)
+		return;
+	for_each_possible_cpu(cpu)
+		tasklet_kill(&per_cpu_ptr(ctx->cq_stage, cpu)->flush);
+}
+
+static long io_uring_get_stats(struct io_ring_ctx *ctx, void __user *arg)
+{
+	struct fuse_queue_cb *cb = ctx->responses_cb;
+	struct pxd_io_stats stats;
+	unsigned long flags;
+
+	if (!cb)
+		return -EINVAL;
+
+	memset(&stats, 0, sizeof(stats));
+	spin_lock_irqsave(&cb->w.lock, flags);
+	stats.cq_events = ctx->cq_events;
+	stats.cq_flushes = ctx->cq_flushes;
+	stats.cq_wakeups = ctx->cq_wakeups;
+	stats.cq_backlog = ctx->cq_backlog;
+	stats.cq_dropped = ctx->cq_dropped;
+	stats.cq_ev_signals = ctx->cq_ev_signals;
+	spin_unlock_irqrestore(&cb->w.lock, flags);
+	stats.sq_spin_ns = atomic64_read(&ctx->sq_spin_ns);
+	stats.sq_sleeps = atomic64_read(&ctx->sq_sleeps);
+	stats.sq_wakeups = atomic64_read(&ctx->sq_wakeups);
+	stats.wq_bound_depth = atomic_read(&ctx->wq_stats[IO_WQ_BOUND].pending);
+	stats.wq_bound_queued = atomic64_read(&ctx->wq_stats[IO_WQ_BOUND].queued);
+	stats.wq_bound_wait_ns =
+		atomic64_read(&ctx->wq_stats[IO_WQ_BOUND].wait_ns);
+	stats.wq_unbound_depth =
+		atomic_read(&ctx->wq_stats[IO_WQ_UNBOUND].pending);
+	stats.wq_unbound_queued =
+		atomic64_read(&ctx->wq_stats[IO_WQ_UNBOUND].queued);
+	stats.wq_unbound_wait_ns =
+		atomic64_read(&ctx->wq_stats[IO_WQ_UNBOUND].wait_ns);
+
+	if (copy_to_user(arg, &stats, sizeof(stats)))
+		return -EFAULT;
+
+	return 0;
+}
+
+#ifdef __PXD_CQ_BENCH__
+struct io_cq_bench_work {
+	struct work_struct	work;
+	struct io_ring_ctx	*ctx;
+	const struct pxd_cq_bench *args;
+	bool			*stop;
+};
+
+/* post the completions of one cpu, a burst per softirq section */
+static void io_cq_bench_fn(struct work_struct *work)
+{
+	struct io_cq_bench_work *bw =
+		container_of(work, struct io_cq_bench_work, work);
+	const struct pxd_cq_bench *args = bw->args;
+	bool softirq = !(args->flags & PXD_CQ_BENCH_PROCESS);
+	u32 i, j, n;
+
+	for (i = 0; i < args->nr_events && !READ_ONCE(*bw->stop); i += n) {
+		n = min(args->burst, args->nr_events - i);
+		if (softirq)
+			local_bh_disable();
+		for (j = 0; j < n; j++)
+			io_cqring_add_event(bw->ctx, i + j, 0);
+		if (softirq)
+			local_bh_enable();
+		cond_resched();
+	}
+}
+
+static void io_cq_bench_counters(struct io_ring_ctx *ctx, u64 *flushes,
+				 u64 *wakeups)
+{
+	struct fuse_queue_cb *cb = ctx->responses_cb;
+	unsigned long flags;
+
+	spin_lock_irqsave(&cb->w.lock, flags);
+	*flushes = ctx->cq_flushes;
+	*wakeups = ctx->cq_wakeups;
+	spin_unlock_irqrestore(&cb->w.lock, flags);
+}
+
+/*
+ * Microbenchmark of CQ posting, built with PXD_CQ_BENCH=1. Workers on
+ * nr_cpus cpus post NOP completions while the caller consumes the CQ ring
+ * the way an application would, reporting how long it took and how many
+ * tail updates and wakeups the completions cost. Only runs on a ring that
+ * never submitted anything, its CQ holds nothing but the bench's entries.
+ */
+static long io_cq_bench(struct io_ring_ctx *ctx, void __user *arg)
+{
+	struct fuse_queue_cb *cb = ctx->responses_cb;
+	struct io_cq_bench_work *works;
+	struct pxd_cq_bench args;
+	u64 total, seen = 0, start, flushes, wakeups;
+	bool stop = false;
+	unsigned nr = 0;
+	long ret = 0;
+	int cpu, i;
+
+	if (!capable(CAP_SYS_ADMIN))
+		return -EPERM;
+	if (!cb)
+		return -EINVAL;
+	if (copy_from_user(&args, arg, sizeof(args)))
+		return -EFAULT;
+	if (!args.nr_events || args.nr_events > PXD_CQ_BENCH_MAX_EVENTS ||
+	    !args.burst || args.burst > PXD_CQ_BENCH_MAX_BURST ||
+	    (args.flags & ~PXD_CQ_BENCH_PROCESS))
+		return -EINVAL;
+	if (!args.nr_cpus || args.nr_cpus > num_online_cpus())
+		args.nr_cpus = num_online_cpus();
+
+	/* keep submitters off the ring while the bench consumes its CQ */
+	spin_lock(&ctx->sq_lock);
+	if (ctx->sq_data || ctx->sq_owned || ctx->cached_sq_head ||
+	    READ_ONCE(cb->r.read) != READ_ONCE(cb->r.write)) {
+		spin_unlock(&ctx->sq_lock);
+		return -EBUSY;
+	}
+	ctx->sq_owned = true;
+	spin_unlock(&ctx->sq_lock);
+
+	works = kcalloc(args.nr_cpus, sizeof(*works), GFP_KERNEL);
+	if (!works) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	io_cq_bench_counters(ctx, &flushes, &wakeups);
+	start = ktime_get_ns();
+	for_each_online_cpu(cpu) {
+		if (nr == args.nr_cpus)
+			break;
+		INIT_WORK(&works[nr].work, io_cq_bench_fn);
+		works[nr].ctx = ctx;
+		works[nr].args = &args;
+		works[nr].stop = &stop;
+		queue_work_on(cpu, system_highpri_wq, &works[nr].work);
+		nr++;
+	}
+	total = (u64) nr * args.nr_events;
+
+	while (seen < total) {
+		u32 tail = smp_load_acquire(&cb->r.write);
+
+		seen += tail - cb->r.read;
+		smp_store_release(&cb->r.read, tail);
+		io_cqring_overflow_kick(ctx);
+		if (signal_pending(current)) {
+			WRITE_ONCE(stop, true);
+			ret = -EINTR;
+			break;
+		}
+		cond_resched();
+	}
+	args.elapsed_ns = ktime_get_ns() - start;
+
+	/* the workers reference args and works, wait for them either way */
+	for (i = 0; i < nr; i++)
+		flush_work(&works[i].work);
+	kfree(works);
+	if (ret)
+		goto out;
+
+	args.events = seen;
+	io_cq_bench_counters(ctx, &args.flushes, &args.wakeups);
+	args.flushes -= flushes;
+	args.wakeups -= wakeups;
+
+	if (copy_to_user(arg, &args, sizeof(args)))
+		ret = -EFAULT;
+out:
+	spin_lock(&ctx->sq_lock);
+	ctx->sq_owned = false;
+	spin_unlock(&ctx->sq_lock);
+	return ret;
+}
+#endif
+
+static void io_ring_drop_ctx_refs(struct io_ring_ctx *ctx, unsigned refs)
+{
+	percpu_ref_put_many(&ctx->refs, refs);
+
+	if (waitqueue_active(&ctx->wait))
+		wake_up(&ctx->wait);
+}
+
+static struct io_kiocb *io_get_req(struct io_ring_ctx *ctx,
+				   struct io_submit_state *state)
+{
+	gfp_t gfp = GFP_KERNEL | __GFP_NOWARN;
+	struct io_kiocb *req;
+
+	if (!percpu_ref_tryget(&ctx->refs))
+		return NULL;
+
+	if (!state) {
+		if (!io_req_cache_get(ctx, (void **) &req, 1))
+			req = kmem_cache_alloc(req_cachep, gfp);
+		if (unlikely(!req))
+			goto out;
+	} else if (!state->free_reqs) {
+		size_t sz;
+		int ret;
+
+		sz = min_t(size_t, state->ios_left, ARRAY_SIZE(state->reqs));
+		ret = io_req_cache_get(ctx, state->reqs, sz);
+		if (ret < sz && kmem_cache_alloc_bulk(req_cachep, gfp, sz - ret,
+						      state->reqs + ret))
+			ret = sz;
+
+		/*
+		 * Bulk alloc is all-or-nothing. If we fail to get a batch,
+		 * retry single alloc to be on the safe side.
+		 */
+		if (unlikely(ret <= 0)) {
+			state->reqs[0] = kmem_cache_alloc(req_cachep, gfp);
+			if (!state->reqs[0])
+				goto out;
+			ret = 1;
+		}
+		state->free_reqs = ret - 1;
+		state->cur_req = 1;
+		req = state->reqs[0];
+	} else {
+		req = state->reqs[state->cur_req];
+		state->free_reqs--;
+		state->cur_req++;
+	}
+
+	req->file = NULL;
+	req->ctx = ctx;
+	req->flags = 0;
+	req->imu = NULL;
+	req->file_node = NULL;
+	req->link_timeout = NULL;
+	/* one is dropped after submission, the other at completion */
+	refcount_set(&req->refs, 2);
+	return req;
+out:
+	io_ring_drop_ctx_refs(ctx, 1);
+	return NULL;
+}
+
+static void io_free_req(struct io_kiocb *req);
+static int io_link_timeout_prep(struct io_kiocb *req);
+static void io_link_timeout_disarm(struct io_kiocb *req);
+
+/*
+ * The head of an IOSQE_IO_LINK chain is done. Hand the rest of the chain to
+ * the next entry and queue it to the workers, or cancel everything left if
+ * the head failed.
+ */
+static void io_req_link_next(struct io_kiocb *req)
+{
+	struct io_kiocb *nxt;
+
+	if (list_empty(&req->link_list))
+		return;
+
+	if (req->flags & REQ_F_FAIL_LINK) {
+		while (!list_empty(&req->link_list)) {
+			nxt = list_first_entry(&req->link_list, struct io_kiocb,
+					       list);
+			list_del(&nxt->list);
+			io_cqring_add_event(req->ctx, nxt->submit.sqe->user_data,
+					    -ECANCELED);
+			/* never submitted, only the chain holds it */
+			kfree(nxt->submit.sqe);
+			io_free_req(nxt);
+		}
+		return;
+	}
+
+	nxt = list_first_entry(&req->link_list, struct io_kiocb, list);
+	list_del_init(&nxt->list);
+	if (!list_empty(&req->link_list)) {
+		INIT_LIST_HEAD(&nxt->link_list);
+		list_splice_init(&req->link_list, &nxt->link_list);
+		nxt->flags |= REQ_F_LINK;
+		if (io_link_timeout_prep(nxt)) {
+			nxt->flags |= REQ_F_FAIL_LINK;
+			io_cqring_add_event(req->ctx, nxt->submit.sqe->user_data,
+					    -ECANCELED);
+			kfree(nxt->submit.sqe);
+			io_free_req(nxt);
+			return;
+		}
+	}
+	io_queue_async_work(req->ctx, nxt, io_req_bound_work(nxt));
+}
+
+static void io_free_req(struct io_kiocb *req)
+{
+	struct io_ring_ctx *ctx = req->ctx;
+
+	/* only the timer clears it once armed, recheck under the lock */
+	if (READ_ONCE(req->link_timeout))
+		io_link_timeout_disarm(req);
+	if (req->flags & REQ_F_LINK)
+		io_req_link_next(req);
+	if (req->file && !(req->flags & REQ_F_FIXED_FILE))
+		fput(req->file);
+	if (req->imu)
+		io_ubuf_put(ctx, req->imu);
+	if (req->file_node)
+		percpu_ref_put(&req->file_node->refs);
+	/* cache before dropping the ref, which may free the ctx */
+	io_req_cache_put(ctx, req);
+	io_ring_drop_ctx_refs(ctx, 1);
+}
+
+static void io_put_req(struct io_kiocb *req)
+{
+	if (refcount_dec_and_test(&req->refs))
+		io_free_req(req);
+}
+
+/* post the result and drop the completion reference */
+static void __io_req_complete(struct io_kiocb *req, long res, unsigned cflags)
+{
+	if (res < 0)
+		req->flags |= REQ_F_FAIL_LINK;
+	__io_cqring_add_event(req->ctx, req->user_data, res, cflags);
+	io_put_req(req);
+}
+
+static void io_req_complete(struct io_kiocb *req, long res)
+{
+	__io_req_complete(req, res, 0);
+}
+
+static void kiocb_end_write(struct kiocb *kiocb)
+{
+	if (kiocb->ki_flags & IOCB_WRITE) {
+		struct inode *inode = file_inode(kiocb->ki_filp);
+
+		/*
+		 * Tell lockdep we inherited freeze protection from submission
+		 * thread.
+		 */
+		if (S_ISREG(inode->i_mode))
+			__sb_writers_acquired(inode->i_sb, SB_FREEZE_WRITE);
+		file_end_write(kiocb->ki_filp);
+	}
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,16,0)
+static void io_complete_rw(struct kiocb *kiocb, long res)
+#else
+static void io_complete_rw(struct kiocb *kiocb, long res, long res2)
+#endif
+{
+	struct io_kiocb *req = container_of(kiocb, struct io_kiocb, rw);
+
+	kiocb_end_write(kiocb);
+
+	io_req_complete(req, res);
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,1,0)
+/*
+ * Polled completions only record the result, the request is posted when
+ * io_do_iopoll() finds it on ->poll_list.
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,16,0)
+static void io_complete_rw_iopoll(struct kiocb *kiocb, long res)
+#else
+static void io_complete_rw_iopoll(struct kiocb *kiocb, long res, long res2)
+#endif
+{
+	struct io_kiocb *req = container_of(kiocb, struct io_kiocb, rw);
+
+	kiocb_end_write(kiocb);
+
+	req->error = res;
+	/* pairs with smp_rmb() in io_do_iopoll() */
+	smp_wmb();
+	req->flags |= REQ_F_IOPOLL_COMPLETED;
+}
+#endif
+
+/*
+ * If we tracked the file through the SCM inflight mechanism, we could support
+ * any file. For now, just ensure that anything potentially problematic is done
+ * inline.
+ */
+static bool io_file_supports_async(struct file *file)
+{
+	umode_t mode = file_inode(file)->i_mode;
+
+	if (S_ISBLK(mode) || S_ISCHR(mode))
+		return true;
+	if (S_ISREG(mode) && file->f_op != &fuse_dev_operations)
+		return true;
+
+	return false;
 }
 
 static int io_prep_rw(struct io_kiocb *req, const struct sqe_submit *s,
@@ -569,6 +1391,19 @@ static int io_prep_rw(struct io_kiocb *req, const struct sqe_submit *s,
 	if (force_nonblock)
 		kiocb->ki_flags |= IOCB_NOWAIT;
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,1,0)
+	if (req->ctx->flags & IORING_SETUP_IOPOLL) {
+		if (!(kiocb->ki_flags & IOCB_DIRECT) ||
+		    !kiocb->ki_filp->f_op->iopoll)
+			return -EOPNOTSUPP;
+
+		req->error = 0;
+		req->flags |= REQ_F_IOPOLL;
+		kiocb->ki_flags |= IOCB_HIPRI;
+		kiocb->ki_complete = io_complete_rw_iopoll;
+		return 0;
+	}
+#endif
 	if (kiocb->ki_flags & IOCB_HIPRI) {
 		pr_info("%s: ki_flags has HIPRI", __func__);
 		return -EINVAL;
@@ -601,26 +1436,67 @@ static inline void io_rw_done(struct kiocb *kiocb, ssize_t ret)
 #endif
 }
 
-static int io_import_fixed(struct io_ring_ctx *ctx, int rw,
+static inline void bvec_iter_init(struct iov_iter *iter, int dir,
+				  struct bio_vec *bvec, unsigned nr,
+				  size_t offset, size_t len)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,20,0)
+	iov_iter_bvec(iter, dir, bvec, nr, len);
+#else
+	iov_iter_bvec(iter, ITER_BVEC | dir, bvec, nr, len);
+#endif
+	iter->iov_offset = offset;
+}
+
+/*
+ * Binary search the coalesced segments for the one holding @offset and
+ * return the offset into it.
+ */
+static unsigned io_ubuf_find_seg(struct io_mapped_ubuf *imu, size_t *offset)
+{
+	unsigned lo = 0, hi = imu->nr_segs - 1;
+
+	while (lo < hi) {
+		unsigned mid = (lo + hi + 1) / 2;
+
+		if (imu->seg_start[mid] <= *offset)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+	*offset -= imu->seg_start[lo];
+	return lo;
+}
+
+static int io_import_fixed(struct io_kiocb *req, int rw,
 			   const struct io_uring_sqe *sqe,
 			   struct iov_iter *iter)
 {
+	struct io_ring_ctx *ctx = req->ctx;
 	size_t len = READ_ONCE(sqe->len);
 	struct io_mapped_ubuf *imu;
-	unsigned index, buf_index;
+	struct bio_vec *segs;
 	size_t offset;
 	u64 buf_addr;
+	unsigned idx;
 
-	/* attempt to use fixed buffers without having provided iovecs */
-	if (unlikely(!ctx->user_bufs))
-		return -EFAULT;
+	/* a punted request imports again, drop what the first try took */
+	if (req->imu) {
+		io_ubuf_put(ctx, req->imu);
+		req->imu = NULL;
+	}
+
+	rcu_read_lock();
+	imu = io_ubuf_lookup(ctx, READ_ONCE(sqe->buf_index));
+	if (imu && !refcount_inc_not_zero(&imu->refs))
+		imu = NULL;
+	rcu_read_unlock();
 
-	buf_index = READ_ONCE(sqe->buf_index);
-	if (unlikely(buf_index >= ctx->nr_user_bufs))
+	/* attempt to use fixed buffers without having provided iovecs */
+	if (unlikely(!imu))
 		return -EFAULT;
+	req->imu = imu;
 
-	index = array_index_nospec(buf_index, ctx->nr_user_bufs);
-	imu = &ctx->user_bufs[index];
 	buf_addr = READ_ONCE(sqe->addr);
 
 	/* overflow */
@@ -631,17 +1507,24 @@ static int io_import_fixed(struct io_ring_ctx *ctx, int rw,
 		return -EFAULT;
 
 	/*
-	 * May not be a start of buffer, set size appropriately
-	 * and advance us to the beginning.
+	 * May not be a start of buffer, start the iterator at the segment or
+	 * page holding buf_addr.
 	 */
 	offset = buf_addr - imu->ubuf;
-	iov_iter_bvec(iter, rw, imu->bvec, imu->nr_bvecs, offset + len);
-	if (offset)
-		iov_iter_advance(iter, offset);
+	segs = smp_load_acquire(&imu->segs);
+	if (segs) {
+		idx = io_ubuf_find_seg(imu, &offset);
+		bvec_iter_init(iter, rw, segs + idx, imu->nr_segs - idx,
+			       offset, len);
+	} else {
+		idx = offset >> PAGE_SHIFT;
+		bvec_iter_init(iter, rw, imu->bvec + idx, imu->nr_bvecs - idx,
+			       offset & ~PAGE_MASK, len);
+	}
 	return 0;
 }
 
-static int io_import_iovec(struct io_ring_ctx *ctx, int rw,
+static int io_import_iovec(struct io_kiocb *req, int rw,
 			   const struct sqe_submit *s, struct iovec **iovec,
 			   struct iov_iter *iter)
 {
@@ -661,7 +1544,7 @@ static int io_import_iovec(struct io_ring_ctx *ctx, int rw,
 	opcode = READ_ONCE(sqe->opcode);
 	if (opcode == IORING_OP_READ_FIXED ||
 	    opcode == IORING_OP_WRITE_FIXED) {
-		int ret = io_import_fixed(ctx, rw, sqe, iter);
+		int ret = io_import_fixed(req, rw, sqe, iter);
 		*iovec = NULL;
 		return ret;
 	}
@@ -697,7 +1580,7 @@ static int io_read(struct io_kiocb *req, const struct sqe_submit *s,
 	if (unlikely(!file->f_op->read_iter))
 		return -EINVAL;
 
-	ret = io_import_iovec(req->ctx, READ, s, &iovec, &iter);
+	ret = io_import_iovec(req, READ, s, &iovec, &iter);
 	if (ret < 0)
 		return ret;
 
@@ -739,7 +1622,7 @@ static int io_write(struct io_kiocb *req, const struct sqe_submit *s,
 		return -EINVAL;
 	}
 
-	ret = io_import_iovec(req->ctx, WRITE, s, &iovec, &iter);
+	ret = io_import_iovec(req, WRITE, s, &iovec, &iter);
 	if (ret < 0)
 		return ret;
 
@@ -783,43 +1666,61 @@ out_free:
 	return ret;
 }
 
+/*
+ * Map @len bytes at @skip into @bio straight onto the bio's own bvec table.
+ * The caller checked that the range lies inside the bio.
+ */
+static void bio_bvec_iter(struct bio *bio, size_t skip, size_t len,
+			  struct iov_iter *iter)
+{
+	struct bio_vec *bv = bio->bi_io_vec + bio->bi_iter.bi_idx;
+	size_t start = bio->bi_iter.bi_bvec_done + skip;
+	size_t mapped = 0;
+	unsigned nr = 0;
+
+	while (start >= bv->bv_len) {
+		start -= bv->bv_len;
+		bv++;
+	}
+	while (mapped < start + len)
+		mapped += bv[nr++].bv_len;
+
+	bvec_iter_init(iter, bio_data_dir(bio), bv, nr, start, len);
+}
+
 // return nr_bytes in iovec if successful
 //   < 0 for failure
 #ifndef __PXD_BIO_MAKEREQ__
+/*
+ * Requests made of a single bio, which is what direct IO and the fastpath
+ * produce, are mapped onto the bio's bvec table without copying it. Merged
+ * requests have one table per bio and are gathered in a single walk into
+ * *iovec, which is only replaced by an allocation past UIO_FASTIOV entries.
+ */
 static int build_bvec(struct fuse_req *req, int *rw, size_t off, size_t len,
 						struct bio_vec **iovec, struct iov_iter *iter)
 {
 	struct request *rq = req->rq;
-	int nr_bvec = 0;
-	struct bio_vec *bvec = NULL;
-	struct bio_vec *alloc_bvec = NULL;
 	struct bio *bio = rq->bio;
+	struct bio_vec *bvec = *iovec;
+	unsigned nr_bvec = 0, max_bvec = UIO_FASTIOV;
 	struct req_iterator rq_iter;
 	struct bio_vec tmp;
 	size_t offset = 0;
 	size_t skip;
-	bool map_end = false;
 	size_t map_len = len;
 
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,4,0)
-	rq_for_each_bvec(tmp, rq, rq_iter) {
-#else
-	rq_for_each_segment(tmp, rq, rq_iter) {
-#endif
-		nr_bvec++;
-	}
+	skip = off - (BIO_SECTOR(bio) << SECTOR_SHIFT);
+	if (off < (BIO_SECTOR(bio) << SECTOR_SHIFT) ||
+	    skip + len > blk_rq_bytes(rq))
+		return -EINVAL;
 
-	if (nr_bvec > UIO_FASTIOV) {
-		alloc_bvec = bvec = kmalloc_array(nr_bvec, sizeof(struct bio_vec),
-			     GFP_NOIO);
-	} else {
-		alloc_bvec = bvec = *iovec;
+	*rw = bio_data_dir(bio);
+	if (bio == rq->biotail) {
+		bio_bvec_iter(bio, skip, len, iter);
+		return len;
 	}
-	if (!bvec)
-		return -EIO;
 
-	skip = off - (BIO_SECTOR(bio) << SECTOR_SHIFT);
-	nr_bvec = 0;
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(5,4,0)
 	rq_for_each_bvec(tmp, rq, rq_iter) {
 #else
@@ -829,115 +1730,55 @@ static int build_bvec(struct fuse_req *req, int *rw, size_t off, size_t len,
 		if (skip >= tmp.bv_len) {
 			skip -= tmp.bv_len;
 			continue;
-		} else if (!map_end) {
-			size_t bvlen = tmp.bv_len - skip;
-			map_end = true;
-			nr_bvec++;
-			offset = skip;
-			if (bvlen >= map_len) {
-				tmp.bv_len = map_len;
-				*bvec = tmp;
-				break;
-			}
-			*bvec = tmp;
-			bvec++;
-			map_len -= bvlen;
-			skip = 0;
-		} else {
-			nr_bvec++;
-			if (map_len <= tmp.bv_len) {
-				tmp.bv_len = map_len;
-				*bvec = tmp;
-				break;
-			}
-			*bvec = tmp;
-			bvec++;
-			map_len -= tmp.bv_len;
 		}
-	}
-	bvec = alloc_bvec;
-	*rw = bio_data_dir(bio);
-
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,20,0)
-	iov_iter_bvec(iter, bio_data_dir(bio), bvec, nr_bvec, len);
-#else
-	iov_iter_bvec(iter, ITER_BVEC | bio_data_dir(bio), bvec, nr_bvec, len);
-#endif
-	iter->iov_offset = offset;
-
-	return len;
-}
-#else
-static int build_bvec(struct fuse_req *req, int *rw, size_t off, size_t len,
-		struct bio_vec **iovec, struct iov_iter *iter)
-{
-	struct bio *bio = req->bio;
-	int nr_bvec = bio->bi_vcnt;
-	struct bio_vec *bvec = NULL;
-	struct bio_vec *alloc_bvec = NULL;
-	struct bvec_iter bv_iter;
-	struct bio_vec bv;
-	size_t offset = 0;
-	size_t skip;
-	bool map_end = false;
-	size_t map_len = len;
-
-	if (nr_bvec > UIO_FASTIOV) {
-		alloc_bvec = bvec = kmalloc_array(nr_bvec, sizeof(struct bio_vec),
-			     GFP_NOIO);
-	} else {
-		alloc_bvec = bvec = *iovec;
-	}
-	if (!bvec)
-		return -EIO;
-
-	nr_bvec = 0;
-	skip = off - (BIO_SECTOR(bio) << SECTOR_SHIFT);
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,1,0)
-	bio_for_each_bvec(bv, bio, bv_iter) {
-#else
-	bio_for_each_segment(bv, bio, bv_iter) {
-#endif
-		if (!bv.bv_len) continue;
-		if (skip >= bv.bv_len) {
-			skip -= bv.bv_len;
-			continue;
-		} else if (!map_end) {
-			size_t bvlen = bv.bv_len - skip;
-			map_end = true;
-			nr_bvec++;
-			offset = skip;
-			if (bvlen >= map_len) {
-				bv.bv_len = map_len;
-				*bvec = bv;
-				break;
-			}
-			*bvec = bv;
-			bvec++;
-			map_len -= bvlen;
-			skip = 0;
-		} else {
-			nr_bvec++;
-			if (map_len <= bv.bv_len) {
-				bv.bv_len = map_len;
-				*bvec = bv;
-				break;
+		if (nr_bvec == max_bvec) {
+			struct bio_vec *grown;
+
+			grown = kmalloc_array(max_bvec * 2, sizeof(*grown),
+					      GFP_NOIO);
+			if (!grown) {
+				if (bvec != *iovec)
+					kfree(bvec);
+				return -EIO;
 			}
-			*bvec = bv;
-			bvec++;
-			map_len -= bv.bv_len;
+			memcpy(grown, bvec, nr_bvec * sizeof(*grown));
+			if (bvec != *iovec)
+				kfree(bvec);
+			bvec = grown;
+			max_bvec *= 2;
 		}
+		if (!nr_bvec) {
+			/* first segment, map from the offset within it */
+			offset = skip;
+			map_len += skip;
+			skip = 0;
+		}
+		bvec[nr_bvec++] = tmp;
+		if (map_len <= tmp.bv_len) {
+			bvec[nr_bvec - 1].bv_len = map_len;
+			break;
+		}
+		map_len -= tmp.bv_len;
 	}
 
-	bvec = alloc_bvec;
-	*rw = bio_data_dir(bio);
-
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,20,0)
-	iov_iter_bvec(iter, bio_data_dir(bio), bvec, nr_bvec, len);
+	*iovec = bvec;
+	bvec_iter_init(iter, *rw, bvec, nr_bvec, offset, len);
+	return len;
+}
 #else
-	iov_iter_bvec(iter, ITER_BVEC | bio_data_dir(bio), bvec, nr_bvec, len);
-#endif
-	iter->iov_offset = offset;
+static int build_bvec(struct fuse_req *req, int *rw, size_t off, size_t len,
+		struct bio_vec **iovec, struct iov_iter *iter)
+{
+	struct bio *bio = req->bio;
+	size_t skip;
+
+	skip = off - (BIO_SECTOR(bio) << SECTOR_SHIFT);
+	if (off < (BIO_SECTOR(bio) << SECTOR_SHIFT) ||
+	    skip + len > bio->bi_iter.bi_size)
+		return -EINVAL;
+
+	*rw = bio_data_dir(bio);
+	bio_bvec_iter(bio, skip, len, iter);
 	return len;
 }
 #endif
@@ -962,6 +1803,10 @@ static int io_import_bvec(struct io_kiocb *req, int *rw,
 		return -ENOENT;
 	}
 
+	/* data of checksum devices is only copied through the fuse device */
+	if (freq->pxd_dev->checksum)
+		return -EOPNOTSUPP;
+
 	return build_bvec(freq, rw, sqe_off, sqe_len, iovec, iter);
 }
 
@@ -1052,6 +1897,185 @@ out_free:
 	return ret;
 }
 
+/*
+ * Copy between two bvec iterators a page at a time. Merged requests may
+ * carry multi-page bvecs, so the source segment is split at page bounds.
+ */
+static size_t io_copy_bvec_iter(struct iov_iter *dst, struct iov_iter *src)
+{
+	size_t copied = 0;
+
+	while (iov_iter_count(src) && iov_iter_count(dst)) {
+		const struct bio_vec *bv = src->bvec;
+		size_t off = bv->bv_offset + src->iov_offset;
+		size_t len = min_t(size_t, bv->bv_len - src->iov_offset,
+				   iov_iter_count(src));
+		struct page *page = bv->bv_page + (off >> PAGE_SHIFT);
+		size_t n;
+
+		off &= ~PAGE_MASK;
+		len = min_t(size_t, len, PAGE_SIZE - off);
+		n = copy_page_to_iter(page, off, len, dst);
+		iov_iter_advance(src, n);
+		copied += n;
+		if (n != len)
+			break;
+	}
+	return copied;
+}
+
+/*
+ * IORING_OP_COPY_DATA moves request data to or from a registered buffer
+ * without a syscall per request, so the server can queue the copies along
+ * with the IO they feed and let the SQ thread run them in one pass.
+ */
+static int io_copy_data(struct io_kiocb *req, const struct sqe_submit *s)
+{
+	const struct io_uring_sqe *sqe = s->sqe;
+	struct bio_vec inline_vecs[UIO_FASTIOV], *bvec = inline_vecs;
+	uint32_t conn_id = READ_ONCE(sqe->copy_conn_id);
+	uint64_t unique_id = READ_ONCE(sqe->copy_unique);
+	size_t len = READ_ONCE(sqe->len);
+	struct iov_iter req_iter, buf_iter;
+	struct fuse_req *freq;
+	size_t copied;
+	int ret, rw;
+
+	if (unlikely(sqe->ioprio || sqe->rw_flags))
+		return -EINVAL;
+
+	freq = request_find_in_ctx(conn_id, unique_id);
+	if (!freq) {
+		printk(KERN_ERR "%s: request %u:%lld not found\n", __func__, conn_id, unique_id);
+		return -ENOENT;
+	}
+
+	if (freq->pxd_dev->checksum)
+		return -EOPNOTSUPP;
+
+	ret = build_bvec(freq, &rw, READ_ONCE(sqe->off), len, &bvec, &req_iter);
+	if (ret < 0)
+		return ret;
+
+	/* the buffer is the destination of write data and the source of reads */
+	ret = io_import_fixed(req, rw == WRITE ? READ : WRITE, sqe, &buf_iter);
+	if (ret < 0)
+		goto out_free;
+
+	if (rw == WRITE)
+		copied = io_copy_bvec_iter(&buf_iter, &req_iter);
+	else
+		copied = io_copy_bvec_iter(&req_iter, &buf_iter);
+
+	io_req_complete(req, copied == len ? copied : -EFAULT);
+	ret = 0;
+out_free:
+	if (bvec != inline_vecs)
+		kfree(bvec);
+	return ret;
+}
+
+static int io_bio_chain_status(struct bio *bio)
+{
+	struct io_kiocb *req = bio->bi_private;
+	int ret = (int) req->error;
+
+	/* an error from building the chain wins over the bio status */
+	if (!ret)
+		ret = blk_status_to_errno(bio->bi_status);
+	bio_put(bio);
+	return ret;
+}
+
+static void io_discard_end_io(struct bio *bio)
+{
+	struct io_kiocb *req = bio->bi_private;
+	int ret = io_bio_chain_status(bio);
+
+	if (ret < 0) {
+		pr_warn("%s: discard failed: ret %d", __func__, ret);
+		if (ret != -EINVAL && ret != -EOPNOTSUPP)
+			ret = -EIO;
+	}
+	io_req_complete(req, ret);
+}
+
+static void io_flush_end_io(struct bio *bio)
+{
+	struct io_kiocb *req = bio->bi_private;
+
+	io_req_complete(req, io_bio_chain_status(bio));
+}
+
+/*
+ * Submit the last bio of a chain, its end_io runs once every bio chained to
+ * it has completed. @error is what building the chain failed with, if any.
+ */
+static void io_submit_bio_chain(struct io_kiocb *req, struct bio *bio,
+				bio_end_io_t *end_io, int error)
+{
+	req->error = error;
+	bio->bi_private = req;
+	bio->bi_end_io = end_io;
+	submit_bio(bio);
+}
+
+static int io_issue_discard(struct block_device *bdev, sector_t sector,
+			    sector_t nr_sects, struct bio **biop)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,12,0)
+	__blkdev_issue_discard(bdev, sector, nr_sects, GFP_NOIO, biop);
+	return 0;
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(5,19,0)
+	return __blkdev_issue_discard(bdev, sector, nr_sects, GFP_NOIO, biop);
+#else
+	return __blkdev_issue_discard(bdev, sector, nr_sects, GFP_NOIO, 0, biop);
+#endif
+}
+
+/*
+ * Build one bio chain for the whole range, zeroing the unaligned head and
+ * tail and discarding the aligned middle. The bios are submitted as the
+ * chain grows, the caller submits the last one. Only ranges up to
+ * PXD_MAX_IO are built inline, larger ones from a worker.
+ */
+static int io_bdev_discard_bios(struct block_device *bdev, loff_t off,
+				loff_t bytes, struct bio **biop)
+{
+	const loff_t discard_granularity = PXD_MAX_DISCARD_GRANULARITY;
+	const loff_t discard_mask = discard_granularity - 1;
+	int ret;
+
+	while (bytes != 0) {
+		loff_t aligned_off = (off + discard_mask) & ~discard_mask;
+		loff_t len;
+
+		if (bytes < discard_granularity || aligned_off != off) {
+			len = bytes < discard_granularity ?
+				bytes : aligned_off - off;
+			ret = __blkdev_issue_zeroout(bdev, off / SECTOR_SIZE,
+					len / SECTOR_SIZE, GFP_NOIO, biop, 0);
+			if (ret < 0) {
+				pr_warn("%s: blkdev_issue_zeroout(unaligned discard) failed: ret %d", __func__, ret);
+				return ret;
+			}
+		} else {
+			len = bytes & ~discard_mask;
+			ret = io_issue_discard(bdev, off / SECTOR_SIZE,
+					len / SECTOR_SIZE, biop);
+			if (ret < 0) {
+				pr_warn("%s: blkdev_issue_discard failed: ret %d", __func__, ret);
+				return ret;
+			}
+		}
+
+		bytes -= len;
+		off += len;
+	}
+
+	return 0;
+}
+
 static int io_discard(struct io_kiocb *req, const struct sqe_submit *s,
 	bool force_nonblock)
 {
@@ -1061,18 +2085,11 @@ static int io_discard(struct io_kiocb *req, const struct sqe_submit *s,
 	struct inode *inode = NULL;
 	struct block_device *bdev = NULL;
 	struct address_space *mapping = NULL;
+	struct bio *bio = NULL;
 
 	loff_t off = READ_ONCE(sqe->off);
 	loff_t bytes = READ_ONCE(sqe->len);
 
-	loff_t discard_granularity = PXD_MAX_DISCARD_GRANULARITY;
-	loff_t discard_mask = discard_granularity - 1;
-
-	/* discard always requires a blocking context */
-	if (force_nonblock) {
-		return -EAGAIN;
-	}
-
 	if (unlikely(!(req->file->f_mode & FMODE_WRITE))) {
 		ret = -EINVAL;
 		goto out;
@@ -1091,57 +2108,38 @@ static int io_discard(struct io_kiocb *req, const struct sqe_submit *s,
 			return -EINVAL;
 		}
 
+		/*
+		 * A range larger than one IO builds a long chain of bios, each
+		 * allocation able to sleep, leave that to a worker rather than
+		 * hold up the submitter or the SQ thread.
+		 */
+		if (force_nonblock && bytes > PXD_MAX_IO)
+			return -EAGAIN;
+
 		mapping = bdev->bd_inode->i_mapping;
-		truncate_inode_pages_range(mapping, off, off + bytes - 1);
-		// handle unaligned discards
-		while (bytes != 0) {
-			loff_t aligned_off = (off + discard_mask) & ~discard_mask;
-			loff_t len = bytes & ~discard_mask;
-
-			if (bytes < discard_granularity) {
-				loff_t zerolen = bytes;
-				ret = blkdev_issue_zeroout(bdev, off / SECTOR_SIZE, zerolen / SECTOR_SIZE,
-							GFP_KERNEL, 0);
-				if (ret < 0) {
-					pr_warn("%s: blkdev_issue_zeroout(small unaligned discard) failed: ret %d", __func__, ret);
-					if (ret != -EINVAL && ret != -EOPNOTSUPP) {
-						ret = -EIO;
-					}
-					break;
-				}
-				bytes = 0;
-				off += zerolen;
-			} else if (aligned_off != off) {
-				loff_t zerolen = aligned_off - off;
-
-				ret = blkdev_issue_zeroout(bdev, off / SECTOR_SIZE, zerolen / SECTOR_SIZE,
-							GFP_KERNEL, 0);
-				if (ret < 0) {
-					pr_warn("%s: blkdev_issue_zeroout(unaligned discard offset) failed: ret %d", __func__, ret);
-					if (ret != -EINVAL && ret != -EOPNOTSUPP) {
-						ret = -EIO;
-					}
-					break;
-				}
-
-				bytes -= zerolen;
-				off += zerolen;
-			} else if (len > 0) {
-				ret = blkdev_issue_discard(bdev, off / SECTOR_SIZE, len / SECTOR_SIZE,
-							GFP_KERNEL, 0);
-				if (ret < 0) {
-					pr_warn("%s: blkdev_issue_discard failed: ret %d", __func__, ret);
-					if (ret != -EINVAL && ret != -EOPNOTSUPP) {
-						ret = -EIO;
-					}
-					break;
-				}
-
-				bytes -= len;
-				off += len;
-			}
+		if (READ_ONCE(mapping->nrpages)) {
+			/* dropping cached pages can wait on page locks and writeback */
+			if (force_nonblock)
+				return -EAGAIN;
+			truncate_inode_pages_range(mapping, off, off + bytes - 1);
+		}
+
+		/* block devices complete from the bio chain, no worker needed */
+		ret = io_bdev_discard_bios(bdev, off, bytes, &bio);
+		if (bio) {
+			io_submit_bio_chain(req, bio, io_discard_end_io, ret);
+			return 0;
 		}
-	} else if (unlikely(!req->file->f_op->fallocate)) {
+		if (ret < 0 && ret != -EINVAL && ret != -EOPNOTSUPP)
+			ret = -EIO;
+		goto out;
+	}
+
+	/* fallocate always requires a blocking context */
+	if (force_nonblock)
+		return -EAGAIN;
+
+	if (unlikely(!req->file->f_op->fallocate)) {
 		printk("%s: fallocate is NULL", __func__);
 		ret = -EOPNOTSUPP;
 	} else {
@@ -1154,13 +2152,56 @@ static int io_discard(struct io_kiocb *req, const struct sqe_submit *s,
 	}
 
 out:
-	io_cqring_add_event(req->ctx, req->user_data, ret);
-	io_put_req(req);
+	io_req_complete(req, ret);
 
 	// always pass submission
 	return 0;
 }
 
+static struct bio *io_flush_bio_alloc(struct block_device *bdev)
+{
+	struct bio *bio;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,18,0)
+	bio = bio_alloc(bdev, 0, REQ_OP_WRITE | REQ_PREFLUSH, GFP_NOIO);
+#else
+	bio = bio_alloc(GFP_NOIO, 0);
+	bio_set_dev(bio, bdev);
+	bio->bi_opf = REQ_OP_WRITE | REQ_PREFLUSH;
+#endif
+	return bio;
+}
+
+/*
+ * fsync of a block device with nothing dirty or under writeback in its page
+ * cache only has to flush the device cache. Submit the flush and complete
+ * from its end_io instead of tying up a worker in vfs_fsync_range(). Block
+ * devices have no metadata to sync, fdatasync and fsync are the same here.
+ */
+static bool io_bdev_fsync_async(struct io_kiocb *req)
+{
+	struct inode *inode = req->file->f_mapping->host;
+	struct address_space *mapping = req->file->f_mapping;
+	int ret;
+
+	if (!S_ISBLK(inode->i_mode))
+		return false;
+	if (mapping_tagged(mapping, PAGECACHE_TAG_DIRTY) ||
+	    mapping_tagged(mapping, PAGECACHE_TAG_WRITEBACK))
+		return false;
+
+	/* report a writeback error since the last fsync, as blkdev_fsync does */
+	ret = file_check_and_advance_wb_err(req->file);
+	if (ret) {
+		io_req_complete(req, ret);
+		return true;
+	}
+
+	io_submit_bio_chain(req, io_flush_bio_alloc(I_BDEV(inode)),
+			    io_flush_end_io, 0);
+	return true;
+}
+
 static int io_syncfs(struct io_kiocb *req, const struct sqe_submit *s,
 	bool force_nonblock)
 {
@@ -1168,6 +2209,13 @@ static int io_syncfs(struct io_kiocb *req, const struct sqe_submit *s,
 	struct inode *inode = file->f_mapping->host;
 	int ret = -EOPNOTSUPP;
 
+	if (S_ISBLK(inode->i_mode)) {
+		/* a block device flush is a single bio, complete from it */
+		io_submit_bio_chain(req, io_flush_bio_alloc(I_BDEV(inode)),
+				    io_flush_end_io, 0);
+		return 0;
+	}
+
 	/* syncfs always requires a blocking context */
 	if (force_nonblock)
 		return -EAGAIN;
@@ -1177,19 +2225,9 @@ static int io_syncfs(struct io_kiocb *req, const struct sqe_submit *s,
 		down_read(&sb->s_umount);
 		ret = sync_filesystem(sb);
 		up_read(&sb->s_umount);
-	} else if (S_ISBLK(inode->i_mode)) {
-		struct block_device *bdev = I_BDEV(inode);
-#if LINUX_VERSION_CODE < KERNEL_VERSION(5,8,0) &&  !defined(QUEUE_FLAG_NOWAIT)
-		ret = blkdev_issue_flush(bdev, GFP_KERNEL, NULL);
-#elif LINUX_VERSION_CODE <= KERNEL_VERSION(5,11,0)
-		ret = blkdev_issue_flush(bdev, GFP_KERNEL);
-#else
-		ret = blkdev_issue_flush(bdev);
-#endif
 	}
 
-	io_cqring_add_event(req->ctx, req->user_data, ret);
-	io_put_req(req);
+	io_req_complete(req, ret);
 
 	// always pass submission
 	return 0;
@@ -1200,11 +2238,29 @@ static int io_syncfs(struct io_kiocb *req, const struct sqe_submit *s,
  */
 static int io_nop(struct io_kiocb *req, u64 user_data)
 {
-	struct io_ring_ctx *ctx = req->ctx;
-	long err = 0;
+	io_req_complete(req, 0);
+	return 0;
+}
 
-	io_cqring_add_event(ctx, user_data, err);
-	io_put_req(req);
+/*
+ * IORING_OP_REQ_DONE finishes a request from the ring instead of a write to
+ * the fuse device. Any read data has been placed in the request pages by
+ * the entries before it.
+ */
+static int io_req_done(struct io_kiocb *req, const struct io_uring_sqe *sqe)
+{
+	uint64_t unique_id = READ_ONCE(sqe->addr);
+	uint32_t conn_id = READ_ONCE(sqe->buf_index);
+	int ret;
+
+	if (unlikely(sqe->ioprio || sqe->off || sqe->len))
+		return -EINVAL;
+
+	ret = request_end_in_ctx(conn_id, unique_id, READ_ONCE(sqe->done_status));
+	if (ret)
+		return ret;
+
+	io_req_complete(req, 0);
 	return 0;
 }
 
@@ -1236,6 +2292,10 @@ static int io_fsync(struct io_kiocb *req, const struct io_uring_sqe *sqe,
 	if (ret)
 		return ret;
 
+	/* nothing cached to write back, a cache flush of the device is all */
+	if (io_bdev_fsync_async(req))
+		return 0;
+
 	/* fsync always requires a blocking context */
 	if (force_nonblock)
 		return -EAGAIN;
@@ -1244,8 +2304,63 @@ static int io_fsync(struct io_kiocb *req, const struct io_uring_sqe *sqe,
 				end > 0 ? end : LLONG_MAX,
 				fsync_flags & IORING_FSYNC_DATASYNC);
 
-	io_cqring_add_event(req->ctx, sqe->user_data, ret);
-	io_put_req(req);
+	io_req_complete(req, ret);
+	return 0;
+}
+
+static int io_sync_file_range(struct io_kiocb *req,
+			      const struct io_uring_sqe *sqe,
+			      bool force_nonblock)
+{
+	struct address_space *mapping;
+	loff_t sqe_off = READ_ONCE(sqe->off);
+	loff_t sqe_len = READ_ONCE(sqe->len);
+	loff_t end = sqe_off + sqe_len - 1;
+	unsigned flags;
+	umode_t mode;
+	int ret;
+
+	flags = READ_ONCE(sqe->sync_range_flags);
+	if (unlikely(flags & ~(SYNC_FILE_RANGE_WAIT_BEFORE |
+			       SYNC_FILE_RANGE_WRITE |
+			       SYNC_FILE_RANGE_WAIT_AFTER)))
+		return -EINVAL;
+
+	ret = io_prep_fsync(req, sqe);
+	if (ret)
+		return ret;
+
+	if (sqe_off < 0)
+		return -EINVAL;
+	/* a zero length syncs to the end of the file */
+	if (!sqe_len)
+		end = LLONG_MAX;
+
+	mode = file_inode(req->file)->i_mode;
+	if (!S_ISREG(mode) && !S_ISBLK(mode) && !S_ISDIR(mode) &&
+	    !S_ISLNK(mode))
+		return -ESPIPE;
+
+	/* writeback may block on the page locks */
+	if (force_nonblock)
+		return -EAGAIN;
+
+	mapping = req->file->f_mapping;
+	if (flags & SYNC_FILE_RANGE_WAIT_BEFORE) {
+		ret = filemap_fdatawait_range(mapping, sqe_off, end);
+		if (ret < 0)
+			goto out;
+	}
+	if (flags & SYNC_FILE_RANGE_WRITE) {
+		ret = filemap_fdatawrite_range(mapping, sqe_off, end);
+		if (ret < 0)
+			goto out;
+	}
+	if (flags & SYNC_FILE_RANGE_WAIT_AFTER)
+		ret = filemap_fdatawait_range(mapping, sqe_off, end);
+
+out:
+	io_req_complete(req, ret);
 	return 0;
 }
 
@@ -1257,7 +2372,7 @@ static void io_poll_remove_one(struct io_kiocb *req)
 	WRITE_ONCE(poll->canceled, true);
 	if (!list_empty(&poll->wait.entry)) {
 		list_del_init(&poll->wait.entry);
-		queue_work(req->ctx->sqo_wq, &req->work);
+		io_queue_async_work(req->ctx, req, false);
 	}
 	spin_unlock(&poll->head->lock);
 
@@ -1327,8 +2442,7 @@ static int io_poll_remove(struct io_kiocb *req, const struct io_uring_sqe *sqe)
 	}
 	spin_unlock_irq(&ctx->completion_lock);
 
-	io_cqring_add_event(req->ctx, sqe->user_data, ret);
-	io_put_req(req);
+	io_req_complete(req, ret);
 	return 0;
 }
 
@@ -1336,8 +2450,7 @@ static void io_poll_complete(struct io_ring_ctx *ctx, struct io_kiocb *req,
 			     unsigned mask)
 {
 	req->poll.done = true;
-	io_cqring_fill_event(ctx, req->user_data, mask);
-	io_commit_cqring(ctx);
+	io_cqring_add_event(ctx, req->user_data, mask);
 }
 
 static void io_poll_complete_work(struct work_struct *work)
@@ -1348,6 +2461,8 @@ static void io_poll_complete_work(struct work_struct *work)
 	struct io_ring_ctx *ctx = req->ctx;
 	unsigned mask = 0;
 
+	io_async_work_start(req);
+
 	if (!READ_ONCE(poll->canceled))
 		mask = poll->file->f_op->poll(poll->file, &pt) & poll->events;
 
@@ -1394,7 +2509,7 @@ static int io_poll_wake(struct wait_queue_entry *wait, unsigned mode, int sync,
 
 		io_put_req(req);
 	} else {
-		queue_work(ctx->sqo_wq, &req->work);
+		io_queue_async_work(ctx, req, false);
 	}
 
 	return 1;
@@ -1471,16 +2586,175 @@ static int io_poll_add(struct io_kiocb *req, const struct io_uring_sqe *sqe)
 			list_add_tail(&req->list, &ctx->cancel_list);
 		spin_unlock(&poll->head->lock);
 	}
-	if (mask) { /* no async, we'd stolen it */
-		ipt.error = 0;
-		io_poll_complete(ctx, req, mask);
+	if (mask) { /* no async, we'd stolen it */
+		ipt.error = 0;
+		io_poll_complete(ctx, req, mask);
+	}
+	spin_unlock_irq(&ctx->completion_lock);
+
+	if (mask) {
+		io_put_req(req);
+	}
+	return ipt.error;
+}
+
+static enum hrtimer_restart io_timeout_fn(struct hrtimer *timer)
+{
+	struct io_kiocb *req = container_of(timer, struct io_kiocb,
+					    timeout.timer);
+	struct io_ring_ctx *ctx = req->ctx;
+	struct io_kiocb *head, *poll_req;
+	unsigned long flags;
+
+	spin_lock_irqsave(&ctx->completion_lock, flags);
+	if (list_empty(&req->list)) {
+		/* lost to a canceller, which completes it */
+		spin_unlock_irqrestore(&ctx->completion_lock, flags);
+		return HRTIMER_NORESTART;
+	}
+	list_del_init(&req->list);
+
+	head = req->timeout.head;
+	if (head) {
+		head->link_timeout = NULL;
+		req->timeout.head = NULL;
+		/* polls are the only requests that can be pulled back */
+		list_for_each_entry(poll_req, &ctx->cancel_list, list) {
+			if (poll_req == head) {
+				io_poll_remove_one(head);
+				break;
+			}
+		}
+	}
+	spin_unlock_irqrestore(&ctx->completion_lock, flags);
+
+	io_req_complete(req, -ETIME);
+	return HRTIMER_NORESTART;
+}
+
+/*
+ * Arm a timeout request. @head is the request a LINK_TIMEOUT bounds, NULL
+ * for a standalone IORING_OP_TIMEOUT.
+ */
+static int io_timeout_setup(struct io_kiocb *req,
+			    const struct io_uring_sqe *sqe,
+			    struct io_kiocb *head)
+{
+	struct io_ring_ctx *ctx = req->ctx;
+	enum hrtimer_mode mode;
+	unsigned long irqflags;
+	unsigned flags;
+
+	if (sqe->addr || sqe->ioprio || sqe->len || sqe->buf_index)
+		return -EINVAL;
+	flags = READ_ONCE(sqe->timeout_flags);
+	if (flags & ~IORING_TIMEOUT_ABS)
+		return -EINVAL;
+
+	mode = (flags & IORING_TIMEOUT_ABS) ? HRTIMER_MODE_ABS :
+					      HRTIMER_MODE_REL;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,13,0)
+	hrtimer_setup(&req->timeout.timer, io_timeout_fn, CLOCK_MONOTONIC,
+		      mode);
+#else
+	hrtimer_init(&req->timeout.timer, CLOCK_MONOTONIC, mode);
+	req->timeout.timer.function = io_timeout_fn;
+#endif
+	req->timeout.head = head;
+
+	/* chains move on from completion context, so may be here in irq */
+	spin_lock_irqsave(&ctx->completion_lock, irqflags);
+	/* teardown may have cancelled the armed timeouts already */
+	if (percpu_ref_is_dying(&ctx->refs)) {
+		spin_unlock_irqrestore(&ctx->completion_lock, irqflags);
+		return -ECANCELED;
+	}
+	list_add_tail(&req->list, &ctx->timeout_list);
+	if (head)
+		head->link_timeout = req;
+	hrtimer_start(&req->timeout.timer, ns_to_ktime(READ_ONCE(sqe->off)),
+		      mode);
+	spin_unlock_irqrestore(&ctx->completion_lock, irqflags);
+	return 0;
+}
+
+/*
+ * A LINK_TIMEOUT directly behind @req in its chain bounds @req rather than
+ * waiting for it. Take it off the chain and arm it before @req is issued.
+ */
+static int io_link_timeout_prep(struct io_kiocb *req)
+{
+	const struct io_uring_sqe *sqe;
+	struct io_kiocb *treq;
+	int ret;
+
+	if (list_empty(&req->link_list))
+		return 0;
+	treq = list_first_entry(&req->link_list, struct io_kiocb, list);
+	sqe = treq->submit.sqe;
+	if (READ_ONCE(sqe->opcode) != IORING_OP_LINK_TIMEOUT)
+		return 0;
+
+	list_del_init(&treq->list);
+	/* never issued, the completion drops the only reference */
+	refcount_set(&treq->refs, 1);
+	treq->user_data = READ_ONCE(sqe->user_data);
+	ret = io_timeout_setup(treq, sqe, req);
+	kfree(sqe);
+	if (ret) {
+		io_cqring_add_event(req->ctx, treq->user_data, ret);
+		io_free_req(treq);
+	}
+	return ret;
+}
+
+/* @req is done, cancel the LINK_TIMEOUT bounding it unless it already fired */
+static void io_link_timeout_disarm(struct io_kiocb *req)
+{
+	struct io_ring_ctx *ctx = req->ctx;
+	struct io_kiocb *treq;
+	unsigned long flags;
+	bool owned = false;
+
+	spin_lock_irqsave(&ctx->completion_lock, flags);
+	treq = req->link_timeout;
+	if (treq) {
+		req->link_timeout = NULL;
+		treq->timeout.head = NULL;
+		if (!list_empty(&treq->list)) {
+			list_del_init(&treq->list);
+			owned = true;
+		}
+	}
+	spin_unlock_irqrestore(&ctx->completion_lock, flags);
+
+	if (owned) {
+		hrtimer_cancel(&treq->timeout.timer);
+		io_req_complete(treq, -ECANCELED);
 	}
-	spin_unlock_irq(&ctx->completion_lock);
+}
 
-	if (mask) {
-		io_put_req(req);
+static void io_timeout_remove_all(struct io_ring_ctx *ctx)
+{
+	struct io_kiocb *req;
+
+	spin_lock_irq(&ctx->completion_lock);
+	while (!list_empty(&ctx->timeout_list)) {
+		req = list_first_entry(&ctx->timeout_list, struct io_kiocb,
+				       list);
+		list_del_init(&req->list);
+		if (req->timeout.head) {
+			req->timeout.head->link_timeout = NULL;
+			req->timeout.head = NULL;
+		}
+		spin_unlock_irq(&ctx->completion_lock);
+
+		hrtimer_cancel(&req->timeout.timer);
+		io_req_complete(req, -ECANCELED);
+
+		spin_lock_irq(&ctx->completion_lock);
 	}
-	return ipt.error;
+	spin_unlock_irq(&ctx->completion_lock);
 }
 
 static int io_req_defer(struct io_ring_ctx *ctx, struct io_kiocb *req,
@@ -1693,18 +2967,192 @@ static int io_socket_poll_remove(struct io_kiocb *req, const struct sqe_submit *
 	return 0;
 }
 
+#ifdef MSG_ZEROCOPY
+#define IO_SEND_MSG_FLAGS	(MSG_MORE | MSG_EOR | MSG_ZEROCOPY)
+#else
+#define IO_SEND_MSG_FLAGS	(MSG_MORE | MSG_EOR)
+#endif
+
+/*
+ * Send on a fixed socket. Data comes from a user iovec, a fixed buffer or
+ * straight from the pages of a pending fuse request. The last two avoid
+ * any copy out of user memory. With MSG_ZEROCOPY set in sqe->msg_flags and
+ * SO_ZEROCOPY enabled on the socket, the network stack also references the
+ * pages instead of copying them; the pages may be reused once the usual
+ * zerocopy notification shows up on the socket error queue. The pages of
+ * a fuse request are released as soon as the request is completed, which
+ * the notification does not hold back, so MSG_ZEROCOPY is refused there.
+ *
+ * A first attempt never blocks. If nothing could be sent the request is
+ * punted to the workers, which then wait for socket space. Short sends
+ * are returned as is.
+ */
 static int io_socket_send(struct io_kiocb *req, const struct sqe_submit *s,
 	bool force_nonblock)
 {
+	struct iovec inline_vecs[UIO_FASTIOV], *iovec = inline_vecs;
+	struct bio_vec inline_bvecs[UIO_FASTIOV], *bvec = inline_bvecs;
+	const struct io_uring_sqe *sqe = s->sqe;
+	struct msghdr msg = {};
+	struct socket *sock;
+	unsigned flags;
+	long ret;
+	int rw;
+
+	if (req->file == NULL) {
+		return -EBADF;
+	}
+	if (!S_ISSOCK(req->file->f_inode->i_mode)) {
+		return -ENOTSOCK;
+	}
+	sock = req->file->private_data;
+
+	flags = READ_ONCE(sqe->msg_flags);
+	if (flags & ~IO_SEND_MSG_FLAGS)
+		return -EINVAL;
+	msg.msg_flags = flags | MSG_NOSIGNAL;
+	if (force_nonblock)
+		msg.msg_flags |= MSG_DONTWAIT;
+
+	switch (READ_ONCE(sqe->ioprio)) {
+	case IORING_SEND_IOVEC:
+		if (READ_ONCE(sqe->buf_index))
+			return -EINVAL;
+		ret = io_import_iovec(req, WRITE, s, &iovec,
+				      &msg.msg_iter);
+		break;
+	case IORING_SEND_FIXED:
+		iovec = NULL;
+		ret = io_import_fixed(req, WRITE, sqe, &msg.msg_iter);
+		break;
+	case IORING_SEND_BIO:
+#ifdef MSG_ZEROCOPY
+		if (flags & MSG_ZEROCOPY)
+			return -EINVAL;
+#endif
+		req->rw.ki_pos = READ_ONCE(sqe->off);
+		iovec = NULL;
+		ret = io_import_bvec(req, &rw, s, &bvec, &msg.msg_iter);
+		if (ret >= 0 && rw != WRITE)
+			ret = -EINVAL;
+		break;
+	default:
+		return -EINVAL;
+	}
+	if (ret < 0)
+		goto out_free;
+
+	ret = sock_sendmsg(sock, &msg);
+	if (ret == -EAGAIN && force_nonblock)
+		goto out_free;
+
+	io_req_complete(req, ret);
+	ret = 0;
+
+out_free:
+	kfree(iovec);
+	if (bvec != inline_bvecs)
+		kfree(bvec);
+	return ret;
+}
+
+static struct io_buf_pool *io_buf_pool_get(struct io_ring_ctx *ctx)
+{
+	struct io_buf_pool *pool = smp_load_acquire(&ctx->buf_pool);
+
+	if (pool)
+		return pool;
+
+	pool = kvzalloc(sizeof(*pool), GFP_KERNEL);
+	if (!pool)
+		return NULL;
+	spin_lock_init(&pool->lock);
+
+	/* lost a race with another SQ thread */
+	if (cmpxchg(&ctx->buf_pool, NULL, pool)) {
+		kvfree(pool);
+		pool = ctx->buf_pool;
+	}
+	return pool;
+}
+
+/*
+ * Add buffers to the receive pool: sqe->fd buffers of sqe->len bytes each,
+ * laid out from sqe->addr, with ids starting at sqe->off. Providing an id
+ * that was handed out by RECV returns it to the pool.
+ */
+static int io_provide_buffers(struct io_kiocb *req, const struct io_uring_sqe *sqe)
+{
+	u64 addr = READ_ONCE(sqe->addr);
+	u32 len = READ_ONCE(sqe->len);
+	u32 nbufs = READ_ONCE(sqe->fd);
+	u64 bid = READ_ONCE(sqe->off);
+	struct io_buf_pool *pool;
+	u32 i;
+
+	if (!len || !nbufs || bid >= PXD_IO_MAX_MSG_BUFS ||
+	    nbufs > PXD_IO_MAX_MSG_BUFS - bid)
+		return -EINVAL;
+	if (addr + (u64)len * nbufs < addr)
+		return -EFAULT;
+
+	pool = io_buf_pool_get(req->ctx);
+	if (!pool)
+		return -ENOMEM;
+
+	spin_lock(&pool->lock);
+	for (i = 0; i < nbufs; i++, bid++, addr += len) {
+		pool->bufs[bid].addr = addr;
+		pool->bufs[bid].len = len;
+		if (pool->bufs[bid].state != IO_BUF_FREE) {
+			pool->bufs[bid].state = IO_BUF_FREE;
+			pool->free[pool->nr_free++] = bid;
+		}
+	}
+	spin_unlock(&pool->lock);
+
+	io_req_complete(req, nbufs);
 	return 0;
 }
 
+static int io_buf_select(struct io_ring_ctx *ctx, u64 *addr, u32 *len)
+{
+	struct io_buf_pool *pool = smp_load_acquire(&ctx->buf_pool);
+	int bid = -ENOBUFS;
+
+	if (!pool)
+		return bid;
+
+	spin_lock(&pool->lock);
+	if (pool->nr_free) {
+		bid = pool->free[--pool->nr_free];
+		pool->bufs[bid].state = IO_BUF_BUSY;
+		*addr = pool->bufs[bid].addr;
+		*len = pool->bufs[bid].len;
+	}
+	spin_unlock(&pool->lock);
+	return bid;
+}
+
+static void io_buf_put(struct io_ring_ctx *ctx, int bid)
+{
+	struct io_buf_pool *pool = ctx->buf_pool;
+
+	spin_lock(&pool->lock);
+	if (pool->bufs[bid].state == IO_BUF_BUSY) {
+		pool->bufs[bid].state = IO_BUF_FREE;
+		pool->free[pool->nr_free++] = bid;
+	}
+	spin_unlock(&pool->lock);
+}
+
 static int io_socket_recv(struct io_kiocb *req, const struct sqe_submit *s,
 	bool force_nonblock)
 {
 	struct iovec inline_vecs[UIO_FASTIOV], *iovec = inline_vecs;
-	int ret;
+	int ret, bid = -1;
 	long ret2, ret3, count;
+	unsigned cflags = 0;
 	struct iov_iter iter;
 	struct io_kiocb *poll_req;
 	struct socket *sock;
@@ -1722,9 +3170,30 @@ static int io_socket_recv(struct io_kiocb *req, const struct sqe_submit *s,
 	req->rw.ki_complete = NULL;
 	req->flags |= REQ_F_NOWAIT;
 
-	ret = io_import_iovec(req->ctx, READ, s, &iovec, &iter);
-	if (ret < 0) {
-		return ret;
+	if (READ_ONCE(s->sqe->flags) & IOSQE_BUFFER_SELECT) {
+		u32 max_len = READ_ONCE(s->sqe->len);
+		u64 addr;
+		u32 len;
+
+		if (!s->has_user)
+			return -EFAULT;
+
+		/* the data is there by now, only take a buffer for it here */
+		bid = io_buf_select(req->ctx, &addr, &len);
+		if (bid < 0)
+			return bid;
+		if (max_len && max_len < len)
+			len = max_len;
+
+		iovec->iov_base = u64_to_user_ptr(addr);
+		iovec->iov_len = len;
+		iov_iter_init(&iter, READ, iovec, 1, len);
+		iovec = NULL;
+	} else {
+		ret = io_import_iovec(req, READ, s, &iovec, &iter);
+		if (ret < 0) {
+			return ret;
+		}
 	}
 
 	count = iov_iter_count(&iter);
@@ -1761,12 +3230,154 @@ static int io_socket_recv(struct io_kiocb *req, const struct sqe_submit *s,
 		}
 	}
 out:
-	io_cqring_add_event(req->ctx, req->user_data, ret2);
-	io_put_req(req);
+	if (bid >= 0) {
+		if (ret2 > 0)
+			cflags = IORING_CQE_F_BUFFER |
+				 (bid << IORING_CQE_BUFFER_SHIFT);
+		else
+			io_buf_put(req->ctx, bid);
+	}
+	__io_req_complete(req, ret2, cflags);
 	kfree(iovec);
 	return 0;
 }
 
+static int io_file_iopoll(struct kiocb *kiocb, bool spin)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,16,0)
+	return kiocb->ki_filp->f_op->iopoll(kiocb, NULL,
+					    spin ? 0 : BLK_POLL_ONESHOT);
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(5,1,0)
+	return kiocb->ki_filp->f_op->iopoll(kiocb, spin);
+#else
+	return 0;
+#endif
+}
+
+/*
+ * Find and post completed polled requests, polling the backing device for
+ * the rest. Called with ->uring_lock held.
+ */
+static int io_do_iopoll(struct io_ring_ctx *ctx, unsigned *nr_events,
+			long min)
+{
+	struct io_kiocb *req, *tmp;
+	LIST_HEAD(done);
+	bool spin;
+	int ret = 0;
+
+	/*
+	 * Only spin for completions if we don't have multiple devices hanging
+	 * off our complete list, and we're under the requested amount.
+	 */
+	spin = !ctx->poll_multi_file && *nr_events < min;
+
+	list_for_each_entry_safe(req, tmp, &ctx->poll_list, list) {
+		if (req->flags & REQ_F_IOPOLL_COMPLETED) {
+			/* pairs with smp_wmb() in io_complete_rw_iopoll() */
+			smp_rmb();
+			list_move_tail(&req->list, &done);
+			continue;
+		}
+		if (!list_empty(&done))
+			break;
+
+		ret = io_file_iopoll(&req->rw, spin);
+		if (ret < 0)
+			break;
+		if (ret && spin)
+			spin = false;
+		ret = 0;
+	}
+
+	while (!list_empty(&done)) {
+		req = list_first_entry(&done, struct io_kiocb, list);
+		list_del(&req->list);
+		(*nr_events)++;
+		io_req_complete(req, (int) req->error);
+	}
+
+	return ret;
+}
+
+/*
+ * Polled requests don't complete on their own, they sit on ->poll_list until
+ * the SQ thread, PXD_IOC_IOPOLL_GETEVENTS or teardown reaps them.
+ */
+static void io_iopoll_req_issued(struct io_kiocb *req)
+{
+	struct io_ring_ctx *ctx = req->ctx;
+
+	mutex_lock(&ctx->uring_lock);
+	if (list_empty(&ctx->poll_list)) {
+		ctx->poll_multi_file = false;
+	} else if (!ctx->poll_multi_file) {
+		struct io_kiocb *list_req;
+
+		list_req = list_first_entry(&ctx->poll_list, struct io_kiocb,
+					    list);
+		if (list_req->rw.ki_filp != req->rw.ki_filp)
+			ctx->poll_multi_file = true;
+	}
+
+	/* completed requests go first, they are reaped without polling */
+	if (req->flags & REQ_F_IOPOLL_COMPLETED)
+		list_add(&req->list, &ctx->poll_list);
+	else
+		list_add_tail(&req->list, &ctx->poll_list);
+	mutex_unlock(&ctx->uring_lock);
+}
+
+static void io_iopoll_reap_events(struct io_ring_ctx *ctx)
+{
+	mutex_lock(&ctx->uring_lock);
+	while (!list_empty(&ctx->poll_list)) {
+		unsigned nr_events = 0;
+
+		io_do_iopoll(ctx, &nr_events, 1);
+
+		if (need_resched()) {
+			mutex_unlock(&ctx->uring_lock);
+			cond_resched();
+			mutex_lock(&ctx->uring_lock);
+		}
+	}
+	mutex_unlock(&ctx->uring_lock);
+}
+
+/* PXD_IOC_IOPOLL_GETEVENTS: reap at least @min polled completions */
+static long io_iopoll_check(struct io_ring_ctx *ctx, unsigned long min)
+{
+	unsigned nr_events = 0;
+	int ret = 0;
+
+	if (!(ctx->flags & IORING_SETUP_IOPOLL))
+		return -EINVAL;
+
+	min = min_t(unsigned long, min, ctx->cq_entries);
+	for (;;) {
+		mutex_lock(&ctx->uring_lock);
+		if (list_empty(&ctx->poll_list)) {
+			mutex_unlock(&ctx->uring_lock);
+			break;
+		}
+		ret = io_do_iopoll(ctx, &nr_events, min);
+		mutex_unlock(&ctx->uring_lock);
+
+		if (ret < 0 || nr_events >= min)
+			break;
+		if (signal_pending(current)) {
+			ret = -EINTR;
+			break;
+		}
+		cond_resched();
+	}
+
+	if (nr_events)
+		return nr_events;
+	return ret;
+}
+
 static int __io_submit_sqe(struct io_ring_ctx *ctx, struct io_kiocb *req,
 			   const struct sqe_submit *s, bool force_nonblock)
 {
@@ -1804,6 +3415,9 @@ static int __io_submit_sqe(struct io_ring_ctx *ctx, struct io_kiocb *req,
 	case IORING_OP_FSYNC:
 		ret = io_fsync(req, s->sqe, force_nonblock);
 		break;
+	case IORING_OP_SYNC_FILE_RANGE:
+		ret = io_sync_file_range(req, s->sqe, force_nonblock);
+		break;
 	case IORING_OP_POLL_ADD:
 		ret = io_poll_add(req, s->sqe);
 		break;
@@ -1837,11 +3451,26 @@ static int __io_submit_sqe(struct io_ring_ctx *ctx, struct io_kiocb *req,
 	case IORING_OP_RECV:
 		ret = io_socket_recv(req, s, force_nonblock);
 		break;
+	case IORING_OP_PROVIDE_BUFFERS:
+		ret = io_provide_buffers(req, s->sqe);
+		break;
+	case IORING_OP_TIMEOUT:
+		ret = io_timeout_setup(req, s->sqe, NULL);
+		break;
+	case IORING_OP_COPY_DATA:
+		ret = io_copy_data(req, s);
+		break;
+	case IORING_OP_REQ_DONE:
+		ret = io_req_done(req, s->sqe);
+		break;
 	default:
 		ret = -EINVAL;
 		break;
 	}
 
+	if (!ret && (req->flags & REQ_F_IOPOLL))
+		io_iopoll_req_issued(req);
+
 	return ret;
 }
 
@@ -1850,7 +3479,10 @@ static inline bool io_sqe_needs_user(const struct io_uring_sqe *sqe)
 	u8 opcode = READ_ONCE(sqe->opcode);
 
 	return !(opcode == IORING_OP_READ_FIXED ||
-		 opcode == IORING_OP_WRITE_FIXED);
+		 opcode == IORING_OP_WRITE_FIXED ||
+		 opcode == IORING_OP_COPY_DATA ||
+		 opcode == IORING_OP_REQ_DONE ||
+		 opcode == IORING_OP_TIMEOUT);
 }
 
 static void io_sq_wq_submit_work(struct work_struct *work)
@@ -1864,6 +3496,8 @@ static void io_sq_wq_submit_work(struct work_struct *work)
 	struct sqe_submit *s = &req->submit;
 	const struct io_uring_sqe *sqe = s->sqe;
 
+	io_async_work_start(req);
+
 	/* Ensure we clear previously set non-block flag */
 	req->rw.ki_flags &= ~IOCB_NOWAIT;
 
@@ -1908,6 +3542,7 @@ static void io_sq_wq_submit_work(struct work_struct *work)
 	io_put_req(req);
 
 	if (ret) {
+		req->flags |= REQ_F_FAIL_LINK;
 		io_cqring_add_event(ctx, sqe->user_data, ret);
 		io_put_req(req);
 	}
@@ -1937,12 +3572,50 @@ static bool io_op_needs_file(const struct io_uring_sqe *sqe)
 	switch (op) {
 	case IORING_OP_NOP:
 	case IORING_OP_POLL_REMOVE:
+	case IORING_OP_PROVIDE_BUFFERS:
+	case IORING_OP_COPY_DATA:
+	case IORING_OP_REQ_DONE:
+	case IORING_OP_TIMEOUT:
+	case IORING_OP_LINK_TIMEOUT:
 		return false;
 	default:
 		return true;
 	}
 }
 
+/*
+ * The last request of a retired generation is gone, nothing can see the
+ * files removed while it was current anymore. May run in irq context, fput()
+ * defers the final release itself.
+ */
+static void io_file_node_release(struct percpu_ref *ref)
+{
+	struct io_file_node *node = container_of(ref, struct io_file_node, refs);
+	struct io_file_put *pfile, *tmp;
+
+	list_for_each_entry_safe(pfile, tmp, &node->put_list, list) {
+		fput(pfile->file);
+		kfree(pfile);
+	}
+	percpu_ref_exit(&node->refs);
+	/* lookups may still be dereferencing it */
+	kfree_rcu(node, rcu);
+}
+
+/* pin the current generation, called under rcu_read_lock() */
+static struct io_file_node *io_file_node_get(struct io_ring_ctx *ctx)
+{
+	struct io_file_node *node;
+
+	do {
+		node = rcu_dereference(ctx->file_node);
+		if (!node)
+			return NULL;
+	} while (!percpu_ref_tryget_live(&node->refs));
+
+	return node;
+}
+
 static int io_req_set_file(struct io_ring_ctx *ctx, const struct sqe_submit *s,
 			   struct io_submit_state *state, struct io_kiocb *req)
 {
@@ -1954,7 +3627,7 @@ static int io_req_set_file(struct io_ring_ctx *ctx, const struct sqe_submit *s,
 
 	if (flags & IOSQE_IO_DRAIN) {
 		req->flags |= REQ_F_IO_DRAIN;
-		req->sequence = ctx->cached_sq_head - 1;
+		req->sequence = s->sequence;
 	}
 
 	if (!io_op_needs_file(s->sqe))
@@ -1966,70 +3639,189 @@ static int io_req_set_file(struct io_ring_ctx *ctx, const struct sqe_submit *s,
 	if (unlikely(!ctx->user_files ||
 		     (unsigned) fd >= ctx->nr_user_files))
 		return -EBADF;
-	req->file = ctx->user_files[fd];
+	fd = array_index_nospec(fd, ctx->nr_user_files);
+
+	rcu_read_lock();
+	req->file_node = io_file_node_get(ctx);
+	if (req->file_node)
+		req->file = rcu_dereference(ctx->user_files[fd]);
+	rcu_read_unlock();
 	req->flags |= REQ_F_FIXED_FILE;
 
 	return 0;
 }
 
+static int io_queue_sqe(struct io_ring_ctx *ctx, struct io_kiocb *req,
+			struct sqe_submit *s)
+{
+	int ret;
+
+	ret = io_req_defer(ctx, req, s->sqe);
+	if (ret) {
+		if (ret == -EIOCBQUEUED)
+			return 0;
+		goto out;
+	}
+
+	ret = __io_submit_sqe(ctx, req, s, true);
+	if (ret == -EAGAIN && !(req->flags & REQ_F_NOWAIT)) {
+		struct io_uring_sqe *sqe_copy;
+
+		sqe_copy = kmalloc(sizeof(*sqe_copy), GFP_KERNEL);
+		if (sqe_copy) {
+			memcpy(sqe_copy, s->sqe, sizeof(*sqe_copy));
+			s->sqe = sqe_copy;
+
+			memcpy(&req->submit, s, sizeof(*s));
+			INIT_WORK(&req->work, io_sq_wq_submit_work);
+			io_queue_async_work(ctx, req, io_req_bound_work(req));
+
+			/*
+			 * Queued up for async execution, worker will release
+			 * submit reference when the iocb is actually
+			 * submitted.
+			 */
+			return 0;
+		}
+	}
+
+out:
+	/* drop submission reference */
+	io_put_req(req);
+
+	/* and drop final reference, if we failed */
+	if (ret) {
+		req->flags |= REQ_F_FAIL_LINK;
+		io_put_req(req);
+	}
+
+	return ret;
+}
+
+/*
+ * Issue the head of a chain once all of it has been collected. The head's
+ * sqe is still valid here, it was fetched in the same batch or copied to
+ * ->sq_link_sqe while the chain was parked. Errors are posted for the head,
+ * the rest of the chain is cancelled on free.
+ */
+static void io_queue_link_head(struct io_ring_ctx *ctx, struct io_kiocb *head)
+{
+	struct sqe_submit s = head->submit;
+	u64 user_data = READ_ONCE(s.sqe->user_data);
+	int ret;
+
+	if (!(head->flags & REQ_F_FAIL_LINK) && io_link_timeout_prep(head))
+		head->flags |= REQ_F_FAIL_LINK;
+
+	if (head->flags & REQ_F_FAIL_LINK) {
+		/* the head failed to prepare, or one of its links did */
+		ret = head->error ? (int) head->error : -ECANCELED;
+		io_cqring_add_event(ctx, user_data, ret);
+		io_put_req(head);
+		io_put_req(head);
+		return;
+	}
+
+	ret = io_queue_sqe(ctx, head, &s);
+	if (ret)
+		io_cqring_add_event(ctx, user_data, ret);
+}
+
+/*
+ * An entry of the open chain in *link failed before it could be queued on
+ * it, cancel the chain. It is issued, failed, once its last entry is seen.
+ */
+static void io_sqe_fail_link(struct io_ring_ctx *ctx, unsigned flags,
+			     struct io_kiocb **link)
+{
+	struct io_kiocb *head = *link;
+
+	if (!head)
+		return;
+
+	head->flags |= REQ_F_FAIL_LINK;
+	if (!(flags & IOSQE_IO_LINK)) {
+		*link = NULL;
+		io_queue_link_head(ctx, head);
+	}
+}
+
+/*
+ * Entries following an IOSQE_IO_LINK entry are not issued, but queued on
+ * the chain head in *link. They are started one by one from the workers as
+ * the previous entry completes; a failed entry cancels the rest.
+ */
 static int io_submit_sqe(struct io_ring_ctx *ctx, struct sqe_submit *s,
-			 struct io_submit_state *state)
+			 struct io_submit_state *state, struct io_kiocb **link)
 {
 	struct io_kiocb *req;
+	unsigned flags;
 	int ret;
 
+	flags = READ_ONCE(s->sqe->flags);
+	req = io_get_req(ctx, state);
+	if (unlikely(!req)) {
+		ret = -EAGAIN;
+		goto fail_link;
+	}
+
 	/* enforce forwards compatibility on users */
-	if (unlikely(s->sqe->flags &
-		     ~(IOSQE_FIXED_FILE | IOSQE_IO_DRAIN | IOSQE_FORCE_ASYNC))) {
+	if (unlikely(flags &
+		     ~(IOSQE_FIXED_FILE | IOSQE_IO_DRAIN | IOSQE_FORCE_ASYNC |
+		       IOSQE_BUFFER_SELECT | IOSQE_IO_LINK))) {
 		pr_info("%s: invalid flags", __func__);
-		return -EINVAL;
+		ret = -EINVAL;
+	} else if ((flags & IOSQE_BUFFER_SELECT) &&
+		   READ_ONCE(s->sqe->opcode) != IORING_OP_RECV) {
+		/* only RECV picks a provided buffer */
+		ret = -EINVAL;
+	} else {
+		ret = io_req_set_file(ctx, s, state, req);
 	}
-
-	req = io_get_req(ctx, state);
-	if (unlikely(!req))
-		return -EAGAIN;
-
-	ret = io_req_set_file(ctx, s, state, req);
-	if (unlikely(ret))
-		goto out;
-
-	ret = io_req_defer(ctx, req, s->sqe);
-	if (ret) {
-		if (ret == -EIOCBQUEUED)
-			ret = 0;
-		return ret;
+	if (unlikely(ret)) {
+		if (*link || !(flags & IOSQE_IO_LINK))
+			goto out;
+		/* a failed head still collects its chain, to cancel it */
+		req->flags |= REQ_F_FAIL_LINK;
 	}
 
-	ret = __io_submit_sqe(ctx, req, s, true);
-	if (ret == -EAGAIN && !(req->flags & REQ_F_NOWAIT)) {
+	if (*link) {
+		struct io_kiocb *head = *link;
 		struct io_uring_sqe *sqe_copy;
 
-		sqe_copy = kmalloc(sizeof(*sqe_copy), GFP_KERNEL);
-		if (sqe_copy) {
-			memcpy(sqe_copy, s->sqe, sizeof(*sqe_copy));
-			s->sqe = sqe_copy;
-
-			memcpy(&req->submit, s, sizeof(*s));
-			INIT_WORK(&req->work, io_sq_wq_submit_work);
-			queue_work(ctx->sqo_wq, &req->work);
-
-			/*
-			 * Queued up for async execution, worker will release
-			 * submit reference when the iocb is actually
-			 * submitted.
-			 */
-			return 0;
+		sqe_copy = kmemdup(s->sqe, sizeof(*sqe_copy), GFP_KERNEL);
+		if (!sqe_copy) {
+			ret = -EAGAIN;
+			goto out;
 		}
+		s->sqe = sqe_copy;
+		memcpy(&req->submit, s, sizeof(*s));
+		INIT_WORK(&req->work, io_sq_wq_submit_work);
+		list_add_tail(&req->list, &head->link_list);
+
+		if (!(flags & IOSQE_IO_LINK)) {
+			*link = NULL;
+			io_queue_link_head(ctx, head);
+		}
+		return 0;
 	}
 
-out:
-	/* drop submission reference */
-	io_put_req(req);
+	if (flags & IOSQE_IO_LINK) {
+		req->flags |= REQ_F_LINK;
+		req->error = ret;
+		INIT_LIST_HEAD(&req->link_list);
+		memcpy(&req->submit, s, sizeof(*s));
+		*link = req;
+		return 0;
+	}
 
-	/* and drop final reference, if we failed */
-	if (ret)
-		io_put_req(req);
+	return io_queue_sqe(ctx, req, s);
 
+out:
+	io_put_req(req);
+	io_put_req(req);
+fail_link:
+	io_sqe_fail_link(ctx, flags, link);
 	return ret;
 }
 
@@ -2039,9 +3831,10 @@ out:
 static void io_submit_state_end(struct io_submit_state *state)
 {
 	blk_finish_plug(&state->plug);
-	if (state->free_reqs)
-		kmem_cache_free_bulk(req_cachep, state->free_reqs,
-					&state->reqs[state->cur_req]);
+	while (state->free_reqs) {
+		io_req_cache_put(state->ctx, state->reqs[state->cur_req++]);
+		state->free_reqs--;
+	}
 }
 
 /*
@@ -2051,6 +3844,7 @@ static void io_submit_state_start(struct io_submit_state *state,
 				  struct io_ring_ctx *ctx, unsigned max_ios)
 {
 	blk_start_plug(&state->plug);
+	state->ctx = ctx;
 	state->free_reqs = 0;
 	state->file = NULL;
 	state->ios_left = max_ios;
@@ -2099,13 +3893,150 @@ static bool io_get_sqring(struct io_ring_ctx *ctx, struct sqe_submit *s)
 
 	s->index = head & ctx->sq_mask;
 	s->sqe = &ctx->requests[head & ctx->sq_mask];
+	s->sequence = head;
 	++ctx->cached_sq_head;
 
 	return true;
 }
 
+static inline bool io_sqring_empty(struct io_ring_ctx *ctx)
+{
+	return READ_ONCE(ctx->cached_sq_head) ==
+		smp_load_acquire(&ctx->requests_cb->r.write);
+}
+
+/*
+ * An IOSQE_IO_LINK chain is only issued once its last entry was seen. The
+ * consumer that owned the ring hands it back here, with the open chain if
+ * any: a chain still open is parked on the ring, its head's sqe copied out
+ * of the batch or ring slot that is about to be reused, for the next fetch
+ * to carry on.
+ */
+static void io_sq_link_put(struct io_ring_ctx *ctx, struct io_kiocb *link)
+{
+	spin_lock(&ctx->sq_lock);
+	if (link && percpu_ref_is_dying(&ctx->refs)) {
+		/* the ring is going away, nothing will close the chain */
+		spin_unlock(&ctx->sq_lock);
+		link->flags |= REQ_F_FAIL_LINK;
+		io_queue_link_head(ctx, link);
+		spin_lock(&ctx->sq_lock);
+		link = NULL;
+	}
+	if (link) {
+		if (link->submit.sqe != &ctx->sq_link_sqe) {
+			memcpy(&ctx->sq_link_sqe, link->submit.sqe,
+			       sizeof(ctx->sq_link_sqe));
+			link->submit.sqe = &ctx->sq_link_sqe;
+		}
+		ctx->sq_link = link;
+	}
+	ctx->sq_owned = false;
+	spin_unlock(&ctx->sq_lock);
+}
+
+/* cancel a parked chain, once ctx->refs is killed */
+static void io_sq_link_cancel(struct io_ring_ctx *ctx)
+{
+	struct io_kiocb *link;
+
+	spin_lock(&ctx->sq_lock);
+	link = ctx->sq_link;
+	ctx->sq_link = NULL;
+	spin_unlock(&ctx->sq_lock);
+
+	if (link) {
+		link->flags |= REQ_F_FAIL_LINK;
+		io_queue_link_head(ctx, link);
+	}
+}
+
+/*
+ * Pull up to @max entries off the SQ ring for an SQ poll thread. Several
+ * threads may drain the same ring, so entries are copied out and the head
+ * is committed under ->sq_lock. Once the lock is dropped the application
+ * is free to reuse the slots, while submission runs from the copies.
+ *
+ * If the batch carries on the ring's open chain, or ends inside a chain,
+ * the chain is claimed into *link. An IOSQE_IO_DRAIN entry is only taken
+ * once every earlier batch was submitted, and starts a batch of its own
+ * that no other batch overtakes. In either case the ring is owned by the
+ * caller and *claimed is set. Every batch is handed back with
+ * io_sq_fetch_done() once submitted.
+ */
+static unsigned io_sq_fetch(struct io_ring_ctx *ctx, struct sqe_submit *sqes,
+			    struct io_uring_sqe *copies, unsigned max,
+			    struct io_kiocb **link, bool *claimed)
+{
+	unsigned nr = 0, chain = 0;
+	bool open, drain = false;
+
+	*link = NULL;
+	*claimed = false;
+	spin_lock(&ctx->sq_lock);
+	/* another thread has the ring to itself, its entries come next */
+	if (ctx->sq_owned) {
+		spin_unlock(&ctx->sq_lock);
+		return 0;
+	}
+
+	open = ctx->sq_link != NULL;
+	while (nr < max && io_get_sqring(ctx, &sqes[nr])) {
+		memcpy(&copies[nr], sqes[nr].sqe, sizeof(copies[nr]));
+		sqes[nr].sqe = &copies[nr];
+		if (copies[nr].flags & IOSQE_IO_DRAIN) {
+			/* wait for the batches in flight, then go alone */
+			if (nr || ctx->sq_batches) {
+				ctx->cached_sq_head--;
+				break;
+			}
+			drain = true;
+		}
+		open = copies[nr].flags & IOSQE_IO_LINK;
+		nr++;
+		if (!open)
+			chain = nr;
+	}
+	/*
+	 * A chain started in this batch after complete entries is left for
+	 * the next fetch. One that starts the batch, or carries on the parked
+	 * chain, is collected here, however long it is.
+	 */
+	if (open && chain && !ctx->sq_link) {
+		ctx->cached_sq_head -= nr - chain;
+		nr = chain;
+		open = false;
+	}
+	if (nr && (open || drain || ctx->sq_link)) {
+		*link = ctx->sq_link;
+		ctx->sq_link = NULL;
+		ctx->sq_owned = true;
+		*claimed = true;
+	}
+	if (nr) {
+		ctx->sq_batches++;
+		io_commit_sqring(ctx);
+	}
+	spin_unlock(&ctx->sq_lock);
+
+	return nr;
+}
+
+/* a batch of io_sq_fetch() was submitted, give back what it claimed */
+static void io_sq_fetch_done(struct io_ring_ctx *ctx, struct io_kiocb *link,
+			     bool claimed)
+{
+	if (claimed)
+		io_sq_link_put(ctx, link);
+
+	spin_lock(&ctx->sq_lock);
+	ctx->sq_batches--;
+	spin_unlock(&ctx->sq_lock);
+}
+
 static int io_submit_sqes(struct io_ring_ctx *ctx, struct sqe_submit *sqes,
-			  unsigned int nr, bool has_user, bool mm_fault)
+			  unsigned int nr, bool has_user, bool mm_fault,
+			  struct io_kiocb **link)
 {
 	struct io_submit_state state, *statep = NULL;
 	int ret, i, submitted = 0;
@@ -2118,11 +4049,13 @@ static int io_submit_sqes(struct io_ring_ctx *ctx, struct sqe_submit *sqes,
 	for (i = 0; i < nr; i++) {
 		if (unlikely(mm_fault)) {
 			ret = -EFAULT;
+			io_sqe_fail_link(ctx, READ_ONCE(sqes[i].sqe->flags),
+					 link);
 		} else {
 			sqes[i].has_user = has_user;
 			sqes[i].needs_lock = true;
 			sqes[i].needs_fixed_file = true;
-			ret = io_submit_sqe(ctx, &sqes[i], statep);
+			ret = io_submit_sqe(ctx, &sqes[i], statep, link);
 		}
 		if (!ret) {
 			submitted++;
@@ -2138,16 +4071,186 @@ static int io_submit_sqes(struct io_ring_ctx *ctx, struct sqe_submit *sqes,
 	return submitted;
 }
 
+/*
+ * Adaptive spin window of an SQ poll thread. sq_data->idle, the longest
+ * sq_thread_idle of the attached rings, is the upper bound. The window
+ * doubles when a sleep was cut short by new work (spinning would have
+ * caught it) and halves when the thread slept past the bound. While
+ * spinning does catch the work, the window is pulled down towards twice
+ * the average gap between batches.
+ */
+#define IO_SQ_IDLE_MIN_NS	(10 * NSEC_PER_USEC)
+
+struct io_sq_idle {
+	u64	window;		/* current spin window, ns */
+	u64	max;		/* sq_data->idle, ns */
+	u64	gap;		/* moving average of the idle gaps, ns */
+	u64	empty_since;	/* rings found empty at, 0 while busy */
+};
+
+static u64 io_sq_idle_max(struct io_sq_data *sqd)
+{
+	u64 max = (u64)jiffies_to_usecs(READ_ONCE(sqd->idle)) * NSEC_PER_USEC;
+
+	return max_t(u64, max, IO_SQ_IDLE_MIN_NS);
+}
+
+static void io_sq_idle_init(struct io_sq_idle *idle, struct io_sq_data *sqd)
+{
+	idle->max = io_sq_idle_max(sqd);
+	idle->window = idle->max;
+	idle->gap = 0;
+	idle->empty_since = 0;
+}
+
+static void io_sq_idle_update(struct io_sq_idle *idle, u64 now, bool slept)
+{
+	u64 gap = now - idle->empty_since;
+
+	idle->empty_since = 0;
+	if (idle->gap)
+		idle->gap = idle->gap - (idle->gap >> 3) + (gap >> 3);
+	else
+		idle->gap = gap;
+
+	if (slept) {
+		if (gap < idle->max)
+			idle->window = min(idle->window * 2, idle->max);
+		else
+			idle->window = max_t(u64, idle->window / 2,
+					     IO_SQ_IDLE_MIN_NS);
+	} else if (idle->window > 4 * idle->gap) {
+		idle->window = max3(idle->window / 2, 2 * idle->gap,
+				    (u64)IO_SQ_IDLE_MIN_NS);
+	}
+}
+
+struct io_sq_batch {
+	struct sqe_submit	sqes[IO_IOPOLL_BATCH];
+	struct io_uring_sqe	copies[IO_IOPOLL_BATCH];
+	struct mm_struct	*cur_mm;
+};
+
+static void io_sq_unuse_mm(struct io_sq_batch *b)
+{
+	if (!b->cur_mm)
+		return;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5,8,0)
+	unuse_mm(b->cur_mm);
+#else
+	kthread_unuse_mm(b->cur_mm);
+#endif
+	mmput(b->cur_mm);
+	b->cur_mm = NULL;
+}
+
+/*
+ * One turn of an SQ thread on one ring: reap polled IO and submit up to a
+ * batch. Returns true if the ring kept the thread busy.
+ */
+static bool io_sq_thread_ctx(struct io_sq_data *sqd, struct io_ring_ctx *ctx,
+			     struct io_sq_batch *b)
+{
+	bool all_fixed, mm_fault = false, busy = false, claimed;
+	struct io_kiocb *link;
+	unsigned i, nr;
+
+	if ((ctx->flags & IORING_SETUP_IOPOLL) &&
+	    !list_empty_careful(&ctx->poll_list)) {
+		unsigned nr_events = 0;
+
+		/* the other SQ threads may reap ours */
+		mutex_lock(&ctx->uring_lock);
+		if (!list_empty(&ctx->poll_list)) {
+			io_do_iopoll(ctx, &nr_events, 0);
+			busy = true;
+		}
+		mutex_unlock(&ctx->uring_lock);
+	}
+
+	io_cqring_overflow_kick(ctx);
+	/*
+	 * Let the consumer catch up before adding more. Not busy, so a
+	 * stalled consumer lets the thread go idle, io_cqring_overflow_flush()
+	 * wakes it once the backlog drains.
+	 */
+	if (unlikely(io_cqring_backlog_full(ctx)))
+		return busy;
+
+	nr = io_sq_fetch(ctx, b->sqes, b->copies, ARRAY_SIZE(b->sqes), &link,
+			 &claimed);
+	if (!nr)
+		return busy;
+
+	/* more work queued than one batch, get a sleeping sibling going */
+	if (nr == ARRAY_SIZE(b->sqes) && sqd->nr_threads > 1 &&
+	    waitqueue_active(&sqd->wait))
+		wake_up(&sqd->wait);
+
+	all_fixed = true;
+	for (i = 0; i < nr; i++) {
+		if (io_sqe_needs_user(b->sqes[i].sqe)) {
+			all_fixed = false;
+			break;
+		}
+	}
+
+	/* Unless all new commands are FIXED regions, grab this ring's mm */
+	if (!all_fixed && b->cur_mm != ctx->sqo_mm) {
+		io_sq_unuse_mm(b);
+		mm_fault = !mmget_not_zero(ctx->sqo_mm);
+		if (!mm_fault) {
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5,8,0)
+			use_mm(ctx->sqo_mm);
+#else
+			kthread_use_mm(ctx->sqo_mm);
+#endif
+			b->cur_mm = ctx->sqo_mm;
+		}
+	}
+
+	io_submit_sqes(ctx, b->sqes, nr, b->cur_mm == ctx->sqo_mm, mm_fault,
+		       &link);
+	io_sq_fetch_done(ctx, link, claimed);
+	return true;
+}
+
+/* flag every ring for a wakeup call, true if they all are still empty */
+static bool io_sq_thread_may_sleep(struct io_sq_data *sqd)
+{
+	struct io_ring_ctx *ctx;
+	bool empty = true;
+
+	list_for_each_entry(ctx, &sqd->ctx_list, sqd_list)
+		ctx->requests_cb->w.need_wake_up = IORING_SQ_NEED_WAKEUP;
+	/* make sure to read SQ tails after writing flags */
+	smp_mb();
+	list_for_each_entry(ctx, &sqd->ctx_list, sqd_list) {
+		/* rings with a full backlog wait for the consumer instead */
+		if (!io_sqring_empty(ctx) && !io_cqring_backlog_full(ctx)) {
+			empty = false;
+			break;
+		}
+	}
+	return empty;
+}
+
+/*
+ * The rings take turns a batch at a time. The thread only sleeps once all
+ * of them have been empty for the spin window, so the polling threads
+ * follow the load rather than the number of rings.
+ */
 static int io_sq_thread(void *data)
 {
-	struct sqe_submit sqes[IO_IOPOLL_BATCH];
-	struct io_ring_ctx *ctx = data;
-	struct mm_struct *cur_mm = NULL;
+	struct io_sq_data *sqd = data;
+	struct io_sq_batch batch, *b = &batch;
+	struct io_ring_ctx *ctx;
 	mm_segment_t old_fs;
 	DEFINE_WAIT(wait);
-	unsigned inflight;
-	unsigned long timeout;
+	struct io_sq_idle idle;
+	bool slept = false;
 
+	b->cur_mm = NULL;
 
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(5,10,0)
 	old_fs = force_uaccess_begin();
@@ -2156,280 +4259,490 @@ static int io_sq_thread(void *data)
 	set_fs(USER_DS);
 #endif
 
-	pr_info("%s: started to %d", __func__, ctx->sq_thread_idle);
+	pr_info("%s: started to %d", __func__, sqd->idle);
 
-	timeout = inflight = 0;
+	io_sq_idle_init(&idle, sqd);
+	down_read(&sqd->rw_lock);
 	while (!kthread_should_park()) {
-		bool all_fixed, mm_fault = false;
-		int i;
-
-		if (inflight) {
-			unsigned nr_events = inflight;
+		bool busy = false;
+		u64 now;
+
+		list_for_each_entry(ctx, &sqd->ctx_list, sqd_list)
+			busy |= io_sq_thread_ctx(sqd, ctx, b);
+
+		if (busy) {
+			if (idle.empty_since) {
+				now = ktime_get_ns();
+				if (!slept)
+					list_for_each_entry(ctx, &sqd->ctx_list,
+							    sqd_list)
+						atomic64_add(now - idle.empty_since,
+							     &ctx->sq_spin_ns);
+				io_sq_idle_update(&idle, now, slept);
+				slept = false;
+			}
+			if (need_resched() || rwsem_is_contended(&sqd->rw_lock)) {
+				up_read(&sqd->rw_lock);
+				cond_resched();
+				down_read(&sqd->rw_lock);
+			}
+			continue;
+		}
 
-			inflight -= nr_events;
-			if (!inflight)
-				timeout = jiffies + ctx->sq_thread_idle;
+		/*
+		 * We're polling. If we're within the current spin window,
+		 * then let us spin without work before going to sleep.
+		 */
+		now = ktime_get_ns();
+		if (!idle.empty_since)
+			idle.empty_since = now;
+		idle.max = io_sq_idle_max(sqd);
+		if (now - idle.empty_since < idle.window) {
+			if (rwsem_is_contended(&sqd->rw_lock)) {
+				up_read(&sqd->rw_lock);
+				down_read(&sqd->rw_lock);
+			}
+			cpu_relax();
+			continue;
 		}
+		if (!slept)
+			list_for_each_entry(ctx, &sqd->ctx_list, sqd_list)
+				atomic64_add(now - idle.empty_since,
+					     &ctx->sq_spin_ns);
 
-		if (!io_get_sqring(ctx, &sqes[0])) {
-			/*
-			 * We're polling. If we're within the defined idle
-			 * period, then let us spin without work before going
-			 * to sleep.
-			 */
-			if (inflight || !time_after(jiffies, timeout)) {
-				cpu_relax();
-				continue;
+		/*
+		 * Drop cur_mm before scheduling, we can't hold it for long
+		 * periods (or over schedule()). Do this before adding
+		 * ourselves to the waitqueue, as the unuse/drop may sleep.
+		 */
+		io_sq_unuse_mm(b);
+
+		/*
+		 * Exclusive wait, so a wakeup from the application starts one
+		 * thread. Siblings are pulled in once that one sees a full
+		 * batch.
+		 */
+		prepare_to_wait_exclusive(&sqd->wait, &wait, TASK_INTERRUPTIBLE);
+		if (io_sq_thread_may_sleep(sqd)) {
+			if (kthread_should_park()) {
+				finish_wait(&sqd->wait, &wait);
+				break;
 			}
+			if (signal_pending(current))
+				flush_signals(current);
+			list_for_each_entry(ctx, &sqd->ctx_list, sqd_list)
+				atomic64_inc(&ctx->sq_sleeps);
+			up_read(&sqd->rw_lock);
+			schedule();
+			finish_wait(&sqd->wait, &wait);
+			down_read(&sqd->rw_lock);
+			list_for_each_entry(ctx, &sqd->ctx_list, sqd_list)
+				atomic64_inc(&ctx->sq_wakeups);
+			slept = true;
+		} else {
+			finish_wait(&sqd->wait, &wait);
+		}
 
-			/*
-			 * Drop cur_mm before scheduling, we can't hold it for
-			 * long periods (or over schedule()). Do this before
-			 * adding ourselves to the waitqueue, as the unuse/drop
-			 * may sleep.
-			 */
-			if (cur_mm) {
-#if LINUX_VERSION_CODE < KERNEL_VERSION(5,8,0)
-				unuse_mm(cur_mm);
+		list_for_each_entry(ctx, &sqd->ctx_list, sqd_list)
+			ctx->requests_cb->w.need_wake_up = 0;
+	}
+	up_read(&sqd->rw_lock);
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,10,0)
+	force_uaccess_end(old_fs);
 #else
-				kthread_unuse_mm(cur_mm);
+	set_fs(old_fs);
 #endif
-				mmput(cur_mm);
-				cur_mm = NULL;
-			}
+	io_sq_unuse_mm(b);
 
-			prepare_to_wait(&ctx->sqo_wait, &wait,
-						TASK_INTERRUPTIBLE);
-
-			/* Tell userspace we may need a wakeup call */
-			ctx->requests_cb->w.need_wake_up =
-				IORING_SQ_NEED_WAKEUP;
-			/* make sure to read SQ tail after writing flags */
-			smp_mb();
-
-			if (!io_get_sqring(ctx, &sqes[0])) {
-				if (kthread_should_park()) {
-					finish_wait(&ctx->sqo_wait, &wait);
-					break;
-				}
-				if (signal_pending(current))
-					flush_signals(current);
-				schedule();
-				finish_wait(&ctx->sqo_wait, &wait);
-
-				ctx->requests_cb->w.need_wake_up = 0;
-				continue;
-			}
-			finish_wait(&ctx->sqo_wait, &wait);
+	kthread_parkme();
 
-			ctx->requests_cb->w.need_wake_up = 0;
-		}
+	return 0;
+}
+
+static struct io_file_node *io_file_node_alloc(void)
+{
+	struct io_file_node *node;
+
+	node = kzalloc(sizeof(*node), GFP_KERNEL);
+	if (!node)
+		return NULL;
+	if (percpu_ref_init(&node->refs, io_file_node_release, 0, GFP_KERNEL)) {
+		kfree(node);
+		return NULL;
+	}
+	INIT_LIST_HEAD(&node->put_list);
+	return node;
+}
+
+static void io_file_node_free(struct io_file_node *node)
+{
+	percpu_ref_exit(&node->refs);
+	kfree(node);
+}
+
+/*
+ * Make @node the current generation and retire the old one. Files removed
+ * while the old one was current are put when its last request is freed.
+ * Called with ->uring_lock held.
+ */
+static void io_file_node_switch(struct io_ring_ctx *ctx,
+				struct io_file_node *node)
+{
+	struct io_file_node *old;
+
+	old = rcu_dereference_protected(ctx->file_node,
+					lockdep_is_held(&ctx->uring_lock));
+	rcu_assign_pointer(ctx->file_node, node);
+	if (old)
+		percpu_ref_kill(&old->refs);
+}
+
+/* no slot below ->file_alloc_hint is free, so this is O(1) in practice */
+static int io_file_slot_alloc(struct io_ring_ctx *ctx)
+{
+	unsigned slot;
+
+	slot = find_next_zero_bit(ctx->file_bitmap, ctx->nr_user_files,
+				  ctx->file_alloc_hint);
+	if (slot >= ctx->nr_user_files)
+		return -ENFILE;
+	return slot;
+}
+
+/*
+ * Clear @slot, the file goes on the put list of the current generation.
+ * Called with ->uring_lock held.
+ */
+static int io_file_slot_clear(struct io_ring_ctx *ctx, unsigned slot)
+{
+	struct io_file_node *node;
+	struct io_file_put *pfile;
+	struct file *file;
+
+	file = rcu_dereference_protected(ctx->user_files[slot],
+					 lockdep_is_held(&ctx->uring_lock));
+	if (!file)
+		return -ENOENT;
+
+	node = rcu_dereference_protected(ctx->file_node,
+					 lockdep_is_held(&ctx->uring_lock));
+	pfile = kmalloc(sizeof(*pfile), GFP_KERNEL);
+	if (!pfile)
+		return -ENOMEM;
+	pfile->file = file;
+	list_add_tail(&pfile->list, &node->put_list);
+
+	RCU_INIT_POINTER(ctx->user_files[slot], NULL);
+	clear_bit(slot, ctx->file_bitmap);
+	if (slot < ctx->file_alloc_hint)
+		ctx->file_alloc_hint = slot;
+	return 0;
+}
+
+/*
+ * Install @fd in @slot, replacing whatever is there. Called with
+ * ->uring_lock held and a current generation in place.
+ */
+static int io_file_slot_set(struct io_ring_ctx *ctx, unsigned slot, int fd)
+{
+	struct file *file;
+	int ret;
+
+	file = fget(fd);
+	if (!file)
+		return -EBADF;
+
+	/*
+	 * Don't allow io_uring instances to be registered. If UNIX
+	 * isn't enabled, then this causes a reference cycle and this
+	 * instance can never get freed. If UNIX is enabled we'll
+	 * handle it just fine, but there's still no point in allowing
+	 * a ring fd as it doesn't support regular read/write anyway.
+	 */
+	if (file->f_op == &fuse_dev_operations) {
+		fput(file);
+		return -EBADF;
+	}
+
+	ret = io_file_slot_clear(ctx, slot);
+	if (ret && ret != -ENOENT) {
+		fput(file);
+		return ret;
+	}
+
+	rcu_assign_pointer(ctx->user_files[slot], file);
+	set_bit(slot, ctx->file_bitmap);
+	if (slot == ctx->file_alloc_hint)
+		ctx->file_alloc_hint++;
+	return 0;
+}
+
+/*
+ * Apply @count updates starting at @offset, or at any free slots for
+ * PXD_FILE_INDEX_ALLOC, which stores the slots back in @fds. In flight
+ * requests keep using the files they looked up, the ones replaced here are
+ * put once those are done. Returns the number of entries done, or an error
+ * if none was. Called with ->uring_lock held.
+ */
+static int __io_sqe_files_update(struct io_ring_ctx *ctx, int offset,
+				 int *fds, unsigned count)
+{
+	struct io_file_node *node;
+	unsigned done;
+	int fd, slot, ret = 0;
+
+	if (!ctx->user_files)
+		return -ENXIO;
+	if (offset != PXD_FILE_INDEX_ALLOC &&
+	    (offset < 0 || count > ctx->nr_user_files - offset))
+		return -EINVAL;
+
+	node = io_file_node_alloc();
+	if (!node)
+		return -ENOMEM;
+
+	/* the first update only needs a generation to put removed files on */
+	if (!rcu_access_pointer(ctx->file_node)) {
+		io_file_node_switch(ctx, node);
+		node = io_file_node_alloc();
+		if (!node)
+			return -ENOMEM;
+	}
 
-		i = 0;
-		all_fixed = true;
-		do {
-			if (all_fixed && io_sqe_needs_user(sqes[i].sqe))
-				all_fixed = false;
+	for (done = 0; done < count; done++) {
+		fd = fds[done];
 
-			i++;
-			if (i == ARRAY_SIZE(sqes))
+		if (offset == PXD_FILE_INDEX_ALLOC) {
+			ret = slot = io_file_slot_alloc(ctx);
+			if (slot < 0)
 				break;
-		} while (io_get_sqring(ctx, &sqes[i]));
-
-		/* Unless all new commands are FIXED regions, grab mm */
-		if (!all_fixed && !cur_mm) {
-			mm_fault = !mmget_not_zero(ctx->sqo_mm);
-			if (!mm_fault) {
-#if LINUX_VERSION_CODE < KERNEL_VERSION(5,8,0)
-				use_mm(ctx->sqo_mm);
-#else
-				kthread_use_mm(ctx->sqo_mm);
-#endif
-				cur_mm = ctx->sqo_mm;
-			}
+			ret = io_file_slot_set(ctx, slot, fd);
+			if (ret)
+				break;
+			fds[done] = slot;
+			continue;
 		}
 
-		inflight += io_submit_sqes(ctx, sqes, i, cur_mm != NULL,
-						mm_fault);
-
-		/* Commit SQ ring head once we've consumed all SQEs */
-		io_commit_sqring(ctx);
-	}
-
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,10,0)
-	force_uaccess_end(old_fs);
-#else
-	set_fs(old_fs);
-#endif
-	if (cur_mm) {
-#if LINUX_VERSION_CODE < KERNEL_VERSION(5,8,0)
-		unuse_mm(cur_mm);
-#else
-		kthread_unuse_mm(cur_mm);
-#endif
-		mmput(cur_mm);
+		slot = offset + done;
+		if (fd == -1) {
+			ret = io_file_slot_clear(ctx, slot);
+			if (ret == -ENOENT)
+				ret = 0;
+		} else {
+			ret = io_file_slot_set(ctx, slot, fd);
+		}
+		if (ret)
+			break;
 	}
 
-	kthread_parkme();
+	/* retire the generation the removed files were put on */
+	io_file_node_switch(ctx, node);
 
-	return 0;
+	return done ? done : ret;
 }
 
-static void __io_sqe_files_unregister(struct io_ring_ctx *ctx)
+static int io_sqe_files_update(struct io_ring_ctx *ctx, void __user *uarg)
 {
-	int i;
+	struct pxd_ioc_update_files arg;
+	int *fds;
+	int ret;
 
-	for (i = 0; i < ctx->nr_user_files; i++)
-		if (ctx->user_files[i])
-			fput(ctx->user_files[i]);
+	if (copy_from_user(&arg, uarg, sizeof(arg)))
+		return -EFAULT;
+	if (!arg.count || arg.count > IORING_MAX_FIXED_FILES)
+		return -EINVAL;
+
+	fds = memdup_user(arg.fds, arg.count * sizeof(*fds));
+	if (IS_ERR(fds))
+		return PTR_ERR(fds);
+
+	mutex_lock(&ctx->uring_lock);
+	ret = __io_sqe_files_update(ctx, arg.offset, fds, arg.count);
+	mutex_unlock(&ctx->uring_lock);
+
+	/* tell the caller where its files went */
+	if (ret > 0 && arg.offset == PXD_FILE_INDEX_ALLOC &&
+	    copy_to_user(arg.fds, fds, ret * sizeof(*fds)))
+		ret = -EFAULT;
+
+	kfree(fds);
+	return ret;
 }
 
+/* called with ->uring_lock held, the table itself is freed with the ctx */
 static int io_sqe_files_unregister(struct io_ring_ctx *ctx)
 {
+	struct io_file_node *node;
+	unsigned slot;
+
 	if (!ctx->user_files)
 		return -ENXIO;
 
-	__io_sqe_files_unregister(ctx);
-	kfree(ctx->user_files);
-	ctx->user_files = NULL;
-	ctx->nr_user_files = 0;
+	node = rcu_dereference_protected(ctx->file_node,
+					 lockdep_is_held(&ctx->uring_lock));
+	if (!node)
+		return 0;
+
+	for_each_set_bit(slot, ctx->file_bitmap, ctx->nr_user_files) {
+		/* no memory for the put list, drop the file right away */
+		if (io_file_slot_clear(ctx, slot) == -ENOMEM) {
+			fput(rcu_dereference_protected(ctx->user_files[slot],
+					lockdep_is_held(&ctx->uring_lock)));
+			RCU_INIT_POINTER(ctx->user_files[slot], NULL);
+			clear_bit(slot, ctx->file_bitmap);
+		}
+	}
+	ctx->file_alloc_hint = 0;
+
+	RCU_INIT_POINTER(ctx->file_node, NULL);
+	percpu_ref_kill(&node->refs);
 	return 0;
 }
 
-static void io_sq_thread_stop(struct io_ring_ctx *ctx)
+static void io_sq_thread_stop(struct io_sq_data *sqd)
 {
-	if (ctx->sqo_thread) {
+	while (sqd->nr_threads) {
+		struct task_struct *tsk = sqd->threads[--sqd->nr_threads];
+
 		/*
 		 * The park is a bit of a work-around, without it we get
 		 * warning spews on shutdown with SQPOLL set and affinity
 		 * set to a single CPU.
 		 */
-		kthread_park(ctx->sqo_thread);
-		kthread_stop(ctx->sqo_thread);
-		ctx->sqo_thread = NULL;
+		kthread_park(tsk);
+		kthread_stop(tsk);
+		sqd->threads[sqd->nr_threads] = NULL;
 	}
 }
 
-static void io_finish_async(struct io_ring_ctx *ctx)
+/* the longest idle time of the attached rings, called with rw_lock held */
+static void io_sq_data_update_idle(struct io_sq_data *sqd)
 {
-	io_sq_thread_stop(ctx);
+	struct io_ring_ctx *ctx;
+	unsigned idle = 0;
 
-	if (ctx->sqo_wq) {
-		destroy_workqueue(ctx->sqo_wq);
-		ctx->sqo_wq = NULL;
-	}
+	list_for_each_entry(ctx, &sqd->ctx_list, sqd_list)
+		idle = max(idle, ctx->sq_thread_idle);
+	WRITE_ONCE(sqd->idle, idle);
 }
 
-static int io_sqe_register_file(struct io_ring_ctx *ctx, int fd)
+/*
+ * Another ring can look up ->sq_data to attach to it while this one is
+ * still being set up or torn down, ->uring_lock may not even be initialised
+ * yet. The pointer is published and cleared under this lock instead.
+ */
+static DEFINE_SPINLOCK(io_sq_data_lock);
+
+static void io_sq_data_attach(struct io_sq_data *sqd, struct io_ring_ctx *ctx)
 {
-	int i;
-	int err;
+	down_write(&sqd->rw_lock);
+	list_add_tail(&ctx->sqd_list, &sqd->ctx_list);
+	io_sq_data_update_idle(sqd);
+	up_write(&sqd->rw_lock);
 
-	mutex_lock(&ctx->uring_lock);
+	spin_lock(&io_sq_data_lock);
+	WRITE_ONCE(ctx->sq_data, sqd);
+	spin_unlock(&io_sq_data_lock);
 
-	for (i = 0; i < ctx->nr_user_files; ++i) {
-		if (!ctx->user_files[i])
-			break;
+	/* a sleeping thread never flagged the new ring for a wakeup call */
+	wake_up(&sqd->wait);
+}
+
+/* take the ring off its SQ threads, the last ring out stops them */
+static void io_sq_data_detach(struct io_ring_ctx *ctx)
+{
+	struct io_sq_data *sqd = ctx->sq_data;
+
+	if (!sqd)
+		return;
+
+	down_write(&sqd->rw_lock);
+	list_del_init(&ctx->sqd_list);
+	io_sq_data_update_idle(sqd);
+	up_write(&sqd->rw_lock);
+
+	spin_lock(&io_sq_data_lock);
+	WRITE_ONCE(ctx->sq_data, NULL);
+	spin_unlock(&io_sq_data_lock);
+
+	if (refcount_dec_and_test(&sqd->refs)) {
+		io_sq_thread_stop(sqd);
+		kfree(sqd);
 	}
+}
 
-	err = -ENFILE;
-	if (i == ctx->nr_user_files)
-		goto out;
+static void io_finish_async(struct io_ring_ctx *ctx)
+{
+	int i;
 
-	err = -EBADF;
-	ctx->user_files[i] = fget(fd);
-	if (!ctx->user_files[i])
-		goto out;
+	io_sq_data_detach(ctx);
 
-	if (ctx->user_files[i]->f_op == &fuse_dev_operations) {
-		fput(ctx->user_files[i]);
-		ctx->user_files[i] = NULL;
-		goto out;
+	for (i = 0; i < IO_WQ_NR; i++) {
+		if (ctx->io_wq[i]) {
+			destroy_workqueue(ctx->io_wq[i]);
+			ctx->io_wq[i] = NULL;
+		}
 	}
+}
 
-	mutex_unlock(&ctx->uring_lock);
-	return i;
+static int io_sqe_register_file(struct io_ring_ctx *ctx, int fd)
+{
+	int ret;
 
-out:
-	pr_err("iouring: register file failed with %d", err);
+	mutex_lock(&ctx->uring_lock);
+	ret = __io_sqe_files_update(ctx, PXD_FILE_INDEX_ALLOC, &fd, 1);
 	mutex_unlock(&ctx->uring_lock);
-	return err;
+	if (ret == 1)
+		return fd;
+
+	pr_err("iouring: register file failed with %d", ret);
+	return ret;
 }
 
 static int io_sqe_unregister_file(struct io_ring_ctx *ctx, int index)
 {
-	if (index >= ctx->nr_user_files)
+	int fd = -1;
+	int ret;
+
+	if (index < 0 || index >= ctx->nr_user_files)
 		return -EINVAL;
 
 	mutex_lock(&ctx->uring_lock);
-
-	if (!ctx->user_files[index]) {
-		mutex_unlock(&ctx->uring_lock);
-		return -ENOENT;
-	}
-
-	fput(ctx->user_files[index]);
-	ctx->user_files[index] = NULL;
-
+	if (!test_bit(index, ctx->file_bitmap))
+		ret = -ENOENT;
+	else
+		ret = __io_sqe_files_update(ctx, index, &fd, 1);
 	mutex_unlock(&ctx->uring_lock);
 
-	return 0;
+	return ret < 0 ? ret : 0;
 }
 
 static int io_sqe_files_register(struct io_ring_ctx *ctx, void __user *arg,
 				 unsigned nr_args)
 {
-	__s32 __user *fds = (__s32 __user *) arg;
-	int fd, ret = 0;
-	unsigned i;
+	int *fds;
+	int ret;
 
-	if (ctx->user_files)
-		return -EBUSY;
 	if (!nr_args)
 		return -EINVAL;
 	if (nr_args > IORING_MAX_FIXED_FILES)
 		return -EMFILE;
+	if (!bitmap_empty(ctx->file_bitmap, ctx->nr_user_files))
+		return -EBUSY;
 
-	ctx->user_files = kcalloc(nr_args, sizeof(struct file *), GFP_KERNEL);
-	if (!ctx->user_files)
-		return -ENOMEM;
-
-	for (i = 0; i < nr_args; i++) {
-		ret = -EFAULT;
-		if (copy_from_user(&fd, &fds[i], sizeof(fd)))
-			break;
-
-		ctx->user_files[i] = fget(fd);
+	fds = memdup_user(arg, nr_args * sizeof(*fds));
+	if (IS_ERR(fds))
+		return PTR_ERR(fds);
 
+	ret = __io_sqe_files_update(ctx, 0, fds, nr_args);
+	if (ret >= 0 && ret != nr_args) {
+		io_sqe_files_unregister(ctx);
 		ret = -EBADF;
-		if (!ctx->user_files[i])
-			break;
-		/*
-		 * Don't allow io_uring instances to be registered. If UNIX
-		 * isn't enabled, then this causes a reference cycle and this
-		 * instance can never get freed. If UNIX is enabled we'll
-		 * handle it just fine, but there's still no point in allowing
-		 * a ring fd as it doesn't support regular read/write anyway.
-		 */
-		if (ctx->user_files[i]->f_op == &fuse_dev_operations) {
-			fput(ctx->user_files[i]);
-			break;
-		}
-		ctx->nr_user_files++;
-		ret = 0;
 	}
 
-	if (ret) {
-		for (i = 0; i < ctx->nr_user_files; i++)
-			fput(ctx->user_files[i]);
-
-		kfree(ctx->user_files);
-		ctx->user_files = NULL;
-		ctx->nr_user_files = 0;
-		return ret;
-	}
-
-	return ret;
+	kfree(fds);
+	return ret < 0 ? ret : 0;
 }
 
 static int check_region(void *base, size_t len)
@@ -2463,6 +4776,72 @@ static int check_region(void *base, size_t len)
 	return 0;
 }
 
+/* largest multi-page segment, bv_len is an unsigned int */
+#define IO_UBUF_MAX_SEG		(UINT_MAX & PAGE_MASK)
+
+static bool io_ubuf_can_merge(struct page *prev, struct page *page,
+			      unsigned seg_len)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,1,0)
+	return seg_len <= IO_UBUF_MAX_SEG - PAGE_SIZE &&
+	       prev + 1 == page &&
+	       page_to_pfn(prev) + 1 == page_to_pfn(page);
+#else
+	/* no multi-page bvecs */
+	return false;
+#endif
+}
+
+/*
+ * Every page of the region is pinned, merge physically contiguous runs
+ * into multi-page segments. Hugepages come out as one segment each. On
+ * failure IO keeps using the per-page bvecs.
+ */
+static void io_ubuf_coalesce(struct io_mapped_ubuf *imu)
+{
+	struct bio_vec *segs;
+	u64 *seg_start;
+	unsigned i, nr = 0, seg_len = 0;
+
+	for (i = 0; i < imu->nr_bvecs; i++) {
+		if (!i || !io_ubuf_can_merge(imu->bvec[i - 1].bv_page,
+					     imu->bvec[i].bv_page, seg_len)) {
+			nr++;
+			seg_len = 0;
+		}
+		seg_len += PAGE_SIZE;
+	}
+	if (nr == imu->nr_bvecs)
+		return;
+
+	segs = kvmalloc_array(nr, sizeof(*segs), GFP_KERNEL);
+	seg_start = kvmalloc_array(nr, sizeof(*seg_start), GFP_KERNEL);
+	if (!segs || !seg_start) {
+		kvfree(segs);
+		kvfree(seg_start);
+		return;
+	}
+
+	nr = 0;
+	for (i = 0; i < imu->nr_bvecs; i++) {
+		if (!i || !io_ubuf_can_merge(imu->bvec[i - 1].bv_page,
+					     imu->bvec[i].bv_page,
+					     segs[nr - 1].bv_len)) {
+			segs[nr].bv_page = imu->bvec[i].bv_page;
+			segs[nr].bv_offset = 0;
+			segs[nr].bv_len = 0;
+			seg_start[nr] = (u64) i << PAGE_SHIFT;
+			nr++;
+		}
+		segs[nr - 1].bv_len += PAGE_SIZE;
+	}
+
+	imu->seg_start = seg_start;
+	imu->nr_segs = nr;
+	/* pairs with smp_load_acquire() in io_import_fixed() */
+	smp_store_release(&imu->segs, segs);
+}
+
 static int io_sqe_register_buffers(struct io_ring_ctx *ctx, void __user *uarg)
 {
 	struct page **pages = NULL;
@@ -2470,27 +4849,27 @@ static int io_sqe_register_buffers(struct io_ring_ctx *ctx, void __user *uarg)
 	int ret = -EINVAL;
 
 	struct io_mapped_ubuf *imu;
-	unsigned long off, start, end, ubuf;
+	unsigned long start, end, ubuf;
 	int pret, nr_pages;
 	struct pxd_ioc_register_buffers arg;
-	size_t size;
 	long offset = 0;
 
 	ret = -EFAULT;
 	if (copy_from_user(&arg, uarg, sizeof(arg)))
-		goto err;
+		return ret;
 
 	ret = check_region(arg.base, arg.len);
 	if (ret)
-		goto err;
+		return ret;
 
-	if (arg.buf_index >= PXD_IO_MAX_USER_BUFS) {
+	mutex_lock(&ctx->ubuf_lock);
+	imu = io_ubuf_lookup(ctx, arg.buf_index);
+	if (!imu) {
 		pr_err("%s: invalid index", __func__);
 		ret = -EINVAL;
 		goto err;
 	}
 
-	imu = &ctx->user_bufs[arg.buf_index];
 	if (imu->ubuf > (uintptr_t) arg.base ||
 	    (uintptr_t) arg.base + arg.len > imu->ubuf + imu->len) {
 		pr_info("%s: address outside of mapped region", __func__);
@@ -2547,17 +4926,18 @@ static int io_sqe_register_buffers(struct io_ring_ctx *ctx, void __user *uarg)
 		goto err;
 	}
 
-	size = arg.len;
 	for (j = 0; j < nr_pages; j++) {
 		imu->bvec[j + offset].bv_page = pages[j];
 		imu->bvec[j + offset].bv_len = PAGE_SIZE;
 		imu->bvec[j + offset].bv_offset = 0;
-		off = 0;
 	}
 
-	kvfree(pages);
-	return 0;
+	imu->nr_pinned += nr_pages;
+	if (imu->nr_pinned == imu->nr_bvecs)
+		io_ubuf_coalesce(imu);
+
 err:
+	mutex_unlock(&ctx->ubuf_lock);
 	kvfree(pages);
 	return ret;
 }
@@ -2565,20 +4945,38 @@ err:
 static int io_sqe_register_region(struct io_ring_ctx *ctx, void __user *uarg)
 {
 	struct pxd_ioc_register_region arg;
-	int buf_index;
+	struct io_mapped_ubuf __rcu **table;
+	int buf_index, free_index = -1;
 	struct io_mapped_ubuf *imu;
 	int ret;
 
 	ret = -EFAULT;
 	if (copy_from_user(&arg, uarg, sizeof(arg)))
-		goto err;
+		return ret;
 
 	ret = check_region(arg.base, arg.len);
 	if (ret)
-		goto err;
+		return ret;
+
+	mutex_lock(&ctx->ubuf_lock);
+	table = ctx->user_bufs;
+	if (!table) {
+		ret = -ENOMEM;
+		table = kvmalloc_array(PXD_IO_MAX_USER_BUFS, sizeof(*table),
+				       GFP_KERNEL | __GFP_ZERO);
+		if (!table)
+			goto err;
+		/* pairs with smp_load_acquire() in io_ubuf_lookup() */
+		smp_store_release(&ctx->user_bufs, table);
+	}
 
 	for (buf_index = 0; buf_index < ctx->nr_user_bufs; ++buf_index) {
-		imu = &ctx->user_bufs[buf_index];
+		imu = io_ubuf_lookup(ctx, buf_index);
+		if (!imu) {
+			if (free_index < 0)
+				free_index = buf_index;
+			continue;
+		}
 		if (imu->ubuf < (uintptr_t) arg.base + arg.len &&
 			(uintptr_t) arg.base < imu->ubuf + imu->len) {
 			pr_info("%s: intersects with existing mapping", __func__);
@@ -2587,29 +4985,84 @@ static int io_sqe_register_region(struct io_ring_ctx *ctx, void __user *uarg)
 		}
 	}
 
-	ret = -EBUSY;
-	if (ctx->nr_user_bufs >= PXD_IO_MAX_USER_BUFS)
-		goto err;
-
-	buf_index = ctx->nr_user_bufs;
-
-	imu = &ctx->user_bufs[buf_index];
+	if (free_index < 0) {
+		ret = -EBUSY;
+		if (ctx->nr_user_bufs >= PXD_IO_MAX_USER_BUFS)
+			goto err;
+		free_index = ctx->nr_user_bufs;
+	}
 
 	ret = -ENOMEM;
-	imu->bvec = kvmalloc_array(arg.len >> PAGE_SHIFT, sizeof(struct bio_vec),
+	imu = kzalloc(sizeof(*imu), GFP_KERNEL);
+	if (!imu)
+		goto err;
+
+	imu->nr_bvecs = arg.len >> PAGE_SHIFT;
+	imu->bvec = kvmalloc_array(imu->nr_bvecs, sizeof(struct bio_vec),
 		GFP_KERNEL | __GFP_ZERO);
-	if (!imu->bvec)
+	if (!imu->bvec) {
+		kfree(imu);
 		goto err;
+	}
 
 	imu->ubuf = (u64)arg.base;
 	imu->len = arg.len;
+	refcount_set(&imu->refs, 1);
+	INIT_WORK(&imu->free_work, io_ubuf_free_work);
 
-	++ctx->nr_user_bufs;
-	return buf_index;
+	rcu_assign_pointer(table[free_index], imu);
+	if (free_index == ctx->nr_user_bufs)
+		++ctx->nr_user_bufs;
+	ret = free_index;
 err:
+	mutex_unlock(&ctx->ubuf_lock);
 	return ret;
 }
 
+/*
+ * Clear the slots of the regions on @list, wait for lookups in flight and
+ * drop the table references. Regions still used by requests are freed by
+ * the last of them.
+ */
+static void io_ubuf_release(struct list_head *list)
+{
+	struct io_mapped_ubuf *imu, *tmp;
+
+	if (list_empty(list))
+		return;
+
+	synchronize_rcu();
+	list_for_each_entry_safe(imu, tmp, list, unreg_list) {
+		list_del(&imu->unreg_list);
+		if (refcount_dec_and_test(&imu->refs))
+			io_ubuf_free(imu);
+	}
+}
+
+/* PXD_IOC_UNREGISTER_REGION: drop one region, the ring keeps running */
+static int io_sqe_unregister_region(struct io_ring_ctx *ctx,
+				    unsigned long buf_index)
+{
+	struct io_mapped_ubuf *imu;
+	LIST_HEAD(list);
+
+	mutex_lock(&ctx->ubuf_lock);
+	imu = io_ubuf_lookup(ctx, buf_index);
+	if (!imu) {
+		mutex_unlock(&ctx->ubuf_lock);
+		return -ENOENT;
+	}
+	RCU_INIT_POINTER(ctx->user_bufs[buf_index], NULL);
+	while (ctx->nr_user_bufs &&
+	       !rcu_access_pointer(ctx->user_bufs[ctx->nr_user_bufs - 1]))
+		ctx->nr_user_bufs--;
+	list_add(&imu->unreg_list, &list);
+	mutex_unlock(&ctx->ubuf_lock);
+
+	io_ubuf_release(&list);
+	return 0;
+}
+
 static int io_sqe_give_buffers(struct io_ring_ctx *ctx, void __user *uarg)
 {
 	struct pxd_ioc_give_buffers arg;
@@ -2677,11 +5130,123 @@ static int io_sqe_free_buffers(struct io_ring_ctx *ctx, struct pxd_ioc_free_buff
 	return i;
 }
 
+/* next online cpu on the same NUMA node as @cpu, wrapping around */
+static int io_sq_next_cpu(int cpu)
+{
+	const struct cpumask *mask = cpumask_of_node(cpu_to_node(cpu));
+	int next;
+
+	next = cpumask_next_and(cpu, mask, cpu_online_mask);
+	if (next >= nr_cpu_ids)
+		next = cpumask_first_and(mask, cpu_online_mask);
+	return next < nr_cpu_ids ? next : cpu;
+}
+
+static int io_sq_thread_start(struct io_sq_data *sqd, int cpu, int node)
+{
+	struct task_struct *tsk;
+	unsigned idx = sqd->nr_threads;
+
+	tsk = kthread_create_on_node(io_sq_thread, sqd,
+		cpu >= 0 ? cpu_to_node(cpu) : node, "pxd-io/%u", idx);
+	if (IS_ERR(tsk))
+		return PTR_ERR(tsk);
+
+	if (cpu >= 0)
+		kthread_bind(tsk, cpu);
+	else if (node != NUMA_NO_NODE)
+		set_cpus_allowed_ptr(tsk, cpumask_of_node(node));
+
+	sqd->threads[idx] = tsk;
+	sqd->nr_threads++;
+	wake_up_process(tsk);
+	return 0;
+}
+
+static struct io_sq_data *io_sq_data_alloc(struct io_uring_params *p)
+{
+	struct io_sq_data *sqd;
+	unsigned i, nr;
+	int node = NUMA_NO_NODE;
+	int cpu = -1;
+	int ret;
+
+	nr = p->sq_threads ? p->sq_threads : 1;
+	if (nr > IO_SQ_MAX_THREADS)
+		return ERR_PTR(-EINVAL);
+
+	/*
+	 * The first thread runs on sq_thread_cpu, any extra ones are
+	 * spread over the other cpus of the same NUMA node. Without a cpu,
+	 * several threads are kept on the node the ring is set up from.
+	 */
+	if (p->flags & IORING_SETUP_SQ_AFF) {
+		cpu = p->sq_thread_cpu;
+		if (cpu >= nr_cpu_ids || !cpu_online(cpu))
+			return ERR_PTR(-EINVAL);
+	} else if (nr > 1) {
+		node = numa_node_id();
+	}
+
+	sqd = kzalloc(sizeof(*sqd), GFP_KERNEL);
+	if (!sqd)
+		return ERR_PTR(-ENOMEM);
+
+	refcount_set(&sqd->refs, 1);
+	init_rwsem(&sqd->rw_lock);
+	INIT_LIST_HEAD(&sqd->ctx_list);
+	init_waitqueue_head(&sqd->wait);
+
+	for (i = 0; i < nr; i++) {
+		ret = io_sq_thread_start(sqd, cpu, node);
+		if (ret) {
+			io_sq_thread_stop(sqd);
+			kfree(sqd);
+			return ERR_PTR(ret);
+		}
+		if (cpu >= 0)
+			cpu = io_sq_next_cpu(cpu);
+	}
+	return sqd;
+}
+
+/* the SQ threads of the ring behind p->wq_fd, with a reference taken */
+static struct io_sq_data *io_sq_data_get(struct io_uring_params *p)
+{
+	struct io_ring_ctx *target;
+	struct io_sq_data *sqd;
+	struct fd f;
+
+	/* the threads and their placement come from the ring attached to */
+	if (p->flags & IORING_SETUP_SQ_AFF)
+		return ERR_PTR(-EINVAL);
+
+	f = fdget(p->wq_fd);
+	if (!f.file)
+		return ERR_PTR(-EBADF);
+	if (f.file->f_op != &io_ring_fops) {
+		fdput(f);
+		return ERR_PTR(-EINVAL);
+	}
+
+	/* the target may be detaching its threads, only take live ones */
+	target = f.file->private_data;
+	spin_lock(&io_sq_data_lock);
+	sqd = target->sq_data;
+	if (sqd && !refcount_inc_not_zero(&sqd->refs))
+		sqd = NULL;
+	spin_unlock(&io_sq_data_lock);
+	fdput(f);
+
+	return sqd ? sqd : ERR_PTR(-EINVAL);
+}
+
 static int io_sq_offload_start(struct io_ring_ctx *ctx, struct io_uring_params *p)
 {
+	struct io_sq_data *sqd;
 	int ret;
 
-	init_waitqueue_head(&ctx->sqo_wait);
+	INIT_LIST_HEAD(&ctx->sqd_list);
 	mmgrab(current->mm);
 	ctx->sqo_mm = current->mm;
 
@@ -2694,32 +5259,41 @@ static int io_sq_offload_start(struct io_ring_ctx *ctx, struct io_uring_params *
 		if (!ctx->sq_thread_idle)
 			ctx->sq_thread_idle = HZ;
 
-		ctx->sqo_thread = kthread_create(io_sq_thread, ctx,
-			"pxd-io");
-		if (IS_ERR(ctx->sqo_thread)) {
-			ret = PTR_ERR(ctx->sqo_thread);
-			ctx->sqo_thread = NULL;
+		if (p->flags & IORING_SETUP_ATTACH_WQ)
+			sqd = io_sq_data_get(p);
+		else
+			sqd = io_sq_data_alloc(p);
+		if (IS_ERR(sqd)) {
+			ret = PTR_ERR(sqd);
 			goto err;
 		}
-		wake_up_process(ctx->sqo_thread);
-	} else if (p->flags & IORING_SETUP_SQ_AFF) {
-		/* Can't have SQ_AFF without SQPOLL */
+		io_sq_data_attach(sqd, ctx);
+		p->sq_threads = sqd->nr_threads;
+	} else if (p->flags & (IORING_SETUP_SQ_AFF | IORING_SETUP_ATTACH_WQ)) {
+		/* Can't have SQ_AFF or ATTACH_WQ without SQPOLL */
 		ret = -EINVAL;
 		goto err;
 	}
 
-	/* Do QD, or 2 * CPUS, whatever is smallest */
-	ctx->sqo_wq = alloc_workqueue("pxd-wq", WQ_UNBOUND | WQ_FREEZABLE,
+	/*
+	 * Unbound workqueues keep a worker pool per NUMA node, work is queued
+	 * on the node of its device or buffer. Block and file IO does QD, or
+	 * 2 * CPUS, whatever is smallest.
+	 */
+	ctx->io_wq[IO_WQ_BOUND] = alloc_workqueue("pxd-wq",
+		WQ_UNBOUND | WQ_FREEZABLE,
 		p->work_queue_num_active == 0 ? 2 * num_online_cpus() :
 		min(p->work_queue_num_active, 2 * num_online_cpus()));
-	if (!ctx->sqo_wq) {
+	ctx->io_wq[IO_WQ_UNBOUND] = alloc_workqueue("pxd-wq-unbound",
+		WQ_UNBOUND | WQ_FREEZABLE, WQ_UNBOUND_MAX_ACTIVE);
+	if (!ctx->io_wq[IO_WQ_BOUND] || !ctx->io_wq[IO_WQ_UNBOUND]) {
 		ret = -ENOMEM;
 		goto err;
 	}
 
 	return 0;
 err:
-	io_sq_thread_stop(ctx);
+	io_sq_data_detach(ctx);
 	mmdrop(ctx->sqo_mm);
 	ctx->sqo_mm = NULL;
 	return ret;
@@ -2734,20 +5308,22 @@ static void io_mem_free(void *ptr)
 
 static int io_sqe_buffer_unregister(struct io_ring_ctx *ctx)
 {
-	int i, j;
+	struct io_mapped_ubuf *imu;
+	LIST_HEAD(list);
+	unsigned i;
 
+	mutex_lock(&ctx->ubuf_lock);
 	for (i = 0; i < ctx->nr_user_bufs; i++) {
-		struct io_mapped_ubuf *imu = &ctx->user_bufs[i];
-
-		for (j = 0; j < imu->nr_bvecs; j++)
-			if (imu->bvec[j].bv_page)
-				put_page(imu->bvec[j].bv_page);
-
-		kvfree(imu->bvec);
-		imu->nr_bvecs = 0;
+		imu = io_ubuf_lookup(ctx, i);
+		if (!imu)
+			continue;
+		RCU_INIT_POINTER(ctx->user_bufs[i], NULL);
+		list_add_tail(&imu->unreg_list, &list);
 	}
-
 	ctx->nr_user_bufs = 0;
+	mutex_unlock(&ctx->ubuf_lock);
+
+	io_ubuf_release(&list);
 	return 0;
 }
 
@@ -2791,15 +5367,30 @@ static int io_eventfd_unregister(struct io_ring_ctx *ctx)
 
 static void io_ring_ctx_free(struct io_ring_ctx *ctx)
 {
+	/* a pending flush may still wake the SQ threads, stop it first */
+	io_cq_stage_stop(ctx);
 	io_finish_async(ctx);
 	if (ctx->sqo_mm)
 		mmdrop(ctx->sqo_mm);
 
 	io_sqe_buffer_unregister(ctx);
+	kvfree(ctx->user_bufs);
+	mutex_lock(&ctx->uring_lock);
 	io_sqe_files_unregister(ctx);
+	mutex_unlock(&ctx->uring_lock);
+	kfree(ctx->user_files);
+	kfree(ctx->file_bitmap);
 	io_eventfd_unregister(ctx);
 
+	io_cqring_overflow_free(ctx);
 	io_mem_free(ctx->queue);
+	free_percpu(ctx->cq_stage);
+	kvfree(ctx->buf_pool);
+
+	spin_lock(&io_ctx_list_lock);
+	list_del(&ctx->ctx_list);
+	spin_unlock(&io_ctx_list_lock);
+	io_req_cache_trim(ctx, ULONG_MAX);
 
 	percpu_ref_exit(&ctx->refs);
 
@@ -2812,9 +5403,17 @@ static void io_ring_ctx_wait_and_kill(struct io_ring_ctx *ctx)
 	percpu_ref_kill(&ctx->refs);
 	mutex_unlock(&ctx->uring_lock);
 
+	io_sq_link_cancel(ctx);
 	io_sock_poll_remove_all(ctx);
 	io_poll_remove_all(ctx);
-	wait_for_completion(&ctx->ctx_done);
+	io_timeout_remove_all(ctx);
+	if (ctx->flags & IORING_SETUP_IOPOLL) {
+		/* polled requests only drop their refs once reaped */
+		while (!wait_for_completion_timeout(&ctx->ctx_done, HZ / 20))
+			io_iopoll_reap_events(ctx);
+	} else {
+		wait_for_completion(&ctx->ctx_done);
+	}
 	io_ring_ctx_free(ctx);
 }
 
@@ -2843,6 +5442,7 @@ static int __io_uring_register(struct io_ring_ctx *ctx, unsigned opcode,
 	 * no new references will come in after we've killed the percpu ref.
 	 */
 	mutex_unlock(&ctx->uring_lock);
+	io_sq_link_cancel(ctx);
 	wait_for_completion(&ctx->ctx_done);
 	mutex_lock(&ctx->uring_lock);
 
@@ -2916,10 +5516,22 @@ out_fput:
 static void io_ring_submit(struct io_ring_ctx *ctx)
 {
 	struct io_submit_state state, *statep = NULL;
+	struct io_kiocb *link;
 	int i;
 	uint32_t read = ctx->requests_cb->r.read;
 	uint32_t write = smp_load_acquire(&ctx->requests_cb->r.write);
 
+	/* own the ring, the open chain if any carries on with this run */
+	spin_lock(&ctx->sq_lock);
+	if (ctx->sq_owned) {
+		spin_unlock(&ctx->sq_lock);
+		return;
+	}
+	link = ctx->sq_link;
+	ctx->sq_link = NULL;
+	ctx->sq_owned = true;
+	spin_unlock(&ctx->sq_lock);
+
 	while (read != write) {
 		int to_submit = write - read;
 
@@ -2939,10 +5551,16 @@ static void io_ring_submit(struct io_ring_ctx *ctx)
 			s.needs_lock = false;
 			s.needs_fixed_file = false;
 
-			ret = io_submit_sqe(ctx, &s, statep);
+			ret = io_submit_sqe(ctx, &s, statep, &link);
 			if (ret)
 				io_cqring_add_event(ctx, s.sqe->user_data, ret);
 		}
+		/* the head may still point into the ring, copy it before commit */
+		if (link && link->submit.sqe != &ctx->sq_link_sqe) {
+			memcpy(&ctx->sq_link_sqe, link->submit.sqe,
+			       sizeof(ctx->sq_link_sqe));
+			link->submit.sqe = &ctx->sq_link_sqe;
+		}
 		io_commit_sqring(ctx);
 
 		if (statep) {
@@ -2953,24 +5571,32 @@ static void io_ring_submit(struct io_ring_ctx *ctx)
 		read = ctx->requests_cb->r.read;
 		write = smp_load_acquire(&ctx->requests_cb->r.write);
 	}
+	io_sq_link_put(ctx, link);
 }
 
 static int io_run_queue(struct io_ring_ctx *ctx)
 {
+	int ret = 0;
+
 	if (!percpu_ref_tryget(&ctx->refs))
 		return 0;
 
-	io_ring_submit(ctx);
+	io_cqring_overflow_kick(ctx);
+	if (io_cqring_backlog_full(ctx))
+		ret = -EBUSY;
+	else
+		io_ring_submit(ctx);
 	io_ring_drop_ctx_refs(ctx, 1);
 
-	return 0;
+	return ret;
 }
 
 static int io_uring_open(struct inode *inode, struct file *file)
 {
 	struct io_ring_ctx *ctx;
 
-	ctx = kmalloc(sizeof(*ctx), GFP_KERNEL);
+	/* zeroed, a ring may look at another's sq_data before its init */
+	ctx = kzalloc(sizeof(*ctx), GFP_KERNEL);
 	if (ctx == NULL)
 		return -ENOMEM;
 
@@ -2997,6 +5623,16 @@ static long io_ring_ioctl_init(struct io_ring_ctx *ctx, unsigned long arg)
 	if (copy_from_user(&params, (void *)arg, sizeof(params)))
 		return -EFAULT;
 
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5,1,0)
+	/* no ->iopoll() in file_operations */
+	if (params.flags & IORING_SETUP_IOPOLL)
+		return -EOPNOTSUPP;
+#endif
+
+	/* the ctx is already on io_ctx_list, it must not be set up twice */
+	if (test_and_set_bit(0, &ctx->init_done))
+		return -EBUSY;
+
 	ret = io_ring_ctx_init(ctx, &params);
 	if (ret != 0)
 		return ret;
@@ -3019,7 +5655,8 @@ static long io_uring_ioctl(struct file *filp, unsigned int cmd, unsigned long ar
 
 	switch (cmd) {
 	case PXD_IOC_WAKE_UP_SQO:
-		wake_up(&ctx->sqo_wait);
+		if (ctx->sq_data)
+			wake_up(&ctx->sq_data->wait);
 		return 0;
 	case PXD_IOC_RUN_IO_QUEUE:
 		return io_run_queue(ctx);
@@ -3027,6 +5664,8 @@ static long io_uring_ioctl(struct file *filp, unsigned int cmd, unsigned long ar
 		return io_sqe_register_file(ctx, arg);
 	case PXD_IOC_UNREGISTER_FILE:
 		return io_sqe_unregister_file(ctx, arg);
+	case PXD_IOC_UPDATE_FILES:
+		return io_sqe_files_update(ctx, (void __user *) arg);
 	case PXD_IOC_INIT_IO:
 		return io_ring_ioctl_init(ctx, arg);
 	case PXD_IOC_REGISTER_BUFFERS:
@@ -3035,10 +5674,20 @@ static long io_uring_ioctl(struct file *filp, unsigned int cmd, unsigned long ar
 		return io_sqe_buffer_unregister(ctx);
 	case PXD_IOC_REGISTER_REGION:
 		return io_sqe_register_region(ctx, (void *) arg);
+	case PXD_IOC_UNREGISTER_REGION:
+		return io_sqe_unregister_region(ctx, arg);
 	case PXD_IOC_GIVE_BUFFERS:
 		return io_sqe_give_buffers(ctx, (void *) arg);
 	case PXD_IOC_FREE_BUFFERS:
 		return io_sqe_free_buffers(ctx, (void *) arg);
+	case PXD_IOC_IO_STATS:
+		return io_uring_get_stats(ctx, (void __user *) arg);
+#ifdef __PXD_CQ_BENCH__
+	case PXD_IOC_CQ_BENCH:
+		return io_cq_bench(ctx, (void __user *) arg);
+#endif
+	case PXD_IOC_IOPOLL_GETEVENTS:
+		return io_iopoll_check(ctx, arg);
 	default:
 		return -ENOTTY;
 	}
@@ -3063,6 +5712,7 @@ static unsigned io_uring_poll(struct file *file, poll_table *wait)
 
 	poll_wait(file, &ctx->cq_wait, wait);
 
+	io_cqring_overflow_kick(ctx);
 	if (cb->r.read != cb->r.write)
 		mask |= POLLIN | POLLRDNORM;
 
@@ -3138,15 +5788,29 @@ static struct miscdevice miscdev;
 
 int io_ring_register_device()
 {
+	int ret;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,0,0)
+	ret = register_shrinker(&io_req_shrinker, "pxd-io-req");
+#else
+	ret = register_shrinker(&io_req_shrinker);
+#endif
+	if (ret)
+		return ret;
+
 	miscdev.minor = MISC_DYNAMIC_MINOR;
 	miscdev.name = "pxd/pxd-io";
 	miscdev.fops = &io_ring_fops;
-	return misc_register(&miscdev);
+	ret = misc_register(&miscdev);
+	if (ret)
+		unregister_shrinker(&io_req_shrinker);
+	return ret;
 }
 
 void io_ring_unregister_device()
 {
 	misc_deregister(&miscdev);
+	unregister_shrinker(&io_req_shrinker);
 }
 
 #endif
@@ -48,13 +48,94 @@
 #include <linux/fs.h>
 #include <linux/percpu-refcount.h>
 #include <linux/miscdevice.h>
+#include <linux/hrtimer.h>
+#include <linux/interrupt.h>
 #include "fuse_i.h"
 
+/*
+ * A registered region. ->bvec has one entry per page, filled in as ranges
+ * are pinned. Once every page is pinned, physically contiguous pages are
+ * merged into ->segs so IO on hugepage backed memory walks a few large
+ * segments instead of one per 4K page.
+ */
 struct io_mapped_ubuf {
 	u64		ubuf;
 	size_t		len;
 	struct		bio_vec *bvec;
 	unsigned int	nr_bvecs;
+	unsigned int	nr_pinned;
+	struct bio_vec	*segs;
+	u64		*seg_start;	/* region offset of each segment */
+	unsigned int	nr_segs;
+	refcount_t	refs;		/* table slot + requests using it */
+	struct list_head unreg_list;
+	struct work_struct free_work;
+};
+
+struct io_overflow_cqe {
+	struct list_head	list;
+	struct io_uring_cqe	cqe;
+};
+
+/* a generation of the fixed file table, see io_file_node_switch() */
+struct io_file_node {
+	struct percpu_ref	refs;
+	struct list_head	put_list;	/* io_file_put, removed files */
+	struct rcu_head		rcu;
+};
+
+struct io_file_put {
+	struct list_head	list;
+	struct file		*file;
+};
+
+/*
+ * Punted requests go to one of two unbound workqueues. Block and file IO is
+ * bounded by work_queue_num_active so it can't starve socket and poll work,
+ * which may block for a long time and goes to the unbounded class.
+ */
+enum {
+	IO_WQ_BOUND,
+	IO_WQ_UNBOUND,
+	IO_WQ_NR,
+};
+
+struct io_wq_stats {
+	atomic_t		pending;	/* queued, not yet running */
+	atomic64_t		queued;
+	atomic64_t		wait_ns;	/* queue to start of work */
+};
+
+/*
+ * Per cpu staging of completions. Completing contexts append here and the
+ * one holding the CQ ring lock moves all staged entries to the ring, so
+ * a burst of completions costs one tail update and one wakeup. Completions
+ * in irq and softirq context leave the move to the flush tasklet, which
+ * runs once the burst is over.
+ */
+#define IO_CQ_STAGE_ENTRIES	64
+struct io_cq_stage {
+	spinlock_t		lock;
+	unsigned		nr;
+	struct tasklet_struct	flush;
+	struct io_uring_cqe	cqes[IO_CQ_STAGE_ENTRIES];
+};
+
+#define IO_SQ_MAX_THREADS	8
+
+/*
+ * SQ poll threads, shared by every ring attached to the one that started
+ * them. The threads walk ctx_list with rw_lock held for read, attaching or
+ * detaching a ring takes it for write.
+ */
+struct io_sq_data {
+	refcount_t		refs;		/* attached rings */
+	struct rw_semaphore	rw_lock;
+	struct list_head	ctx_list;
+	unsigned		idle;		/* longest sq_thread_idle, jiffies */
+	struct task_struct	*threads[IO_SQ_MAX_THREADS];
+	unsigned		nr_threads;
+	wait_queue_head_t	wait;
 };
 
 struct io_ring_ctx {
@@ -82,11 +163,28 @@ struct io_ring_ctx {
 		struct list_head	defer_list;
 	} ____cacheline_aligned_in_smp;
 
-	/* IO offload */
-	struct workqueue_struct	*sqo_wq;
-	struct task_struct	*sqo_thread;	/* if using sq thread polling */
+	/* IO offload, see io_queue_async_work() */
+	struct workqueue_struct	*io_wq[IO_WQ_NR];
+	struct io_wq_stats	wq_stats[IO_WQ_NR];
+	/* if using sq thread polling */
+	struct io_sq_data	*sq_data;
+	struct list_head	sqd_list;	/* on sq_data->ctx_list */
+	spinlock_t		sq_lock;	/* serializes SQ ring consumers */
+	/*
+	 * Under sq_lock. ->sq_link is the IOSQE_IO_LINK chain left open by
+	 * the last fetch, its parked head points at ->sq_link_sqe.
+	 * ->sq_owned is set while one consumer has the ring to itself, to
+	 * collect the open chain or to submit an IOSQE_IO_DRAIN batch.
+	 * ->sq_batches counts fetched batches not submitted yet.
+	 */
+	struct io_kiocb		*sq_link;
+	bool			sq_owned;
+	unsigned		sq_batches;
+	struct io_uring_sqe	sq_link_sqe;
+	atomic64_t		sq_spin_ns;
+	atomic64_t		sq_sleeps;
+	atomic64_t		sq_wakeups;
 	struct mm_struct	*sqo_mm;
-	wait_queue_head_t	sqo_wait;
 
 	struct {
 		/* CQ ring */
@@ -98,22 +196,56 @@ struct io_ring_ctx {
 		struct fasync_struct	*cq_fasync;
 	} ____cacheline_aligned_in_smp;
 
+	struct {
+		struct io_cq_stage __percpu *cq_stage;
+		cpumask_t		cq_stage_mask; /* cpus with staged cqes */
+		atomic_t		cq_flush_pending;
+		/* protected by responses_cb->w.lock */
+		u64			cq_events;
+		u64			cq_flushes;
+		u64			cq_wakeups;
+		u64			cq_ev_signals;
+		/* completions that found the CQ ring full, oldest first */
+		struct list_head	cq_overflow_list;
+		unsigned		cq_backlog;
+		u64			cq_dropped;
+	} ____cacheline_aligned_in_smp;
+
+	struct {
+		/* freed io_kiocbs kept for reuse, LIFO */
+		spinlock_t		req_cache_lock;
+		struct list_head	req_cache;
+		unsigned		req_cache_nr;
+		bool			req_cache_active; /* used since last shrink */
+	} ____cacheline_aligned_in_smp;
+	struct list_head	ctx_list;	/* on io_ctx_list */
+
 	/*
-	 * If used, fixed file set. Writers must ensure that ->refs is dead,
-	 * readers must ensure that ->refs is alive as long as the file* is
-	 * used. Only updated through io_uring_register(2).
+	 * Fixed file set. Slots are RCU protected and updated under
+	 * uring_lock, ->file_bitmap tracks the used ones. Requests pin the
+	 * current ->file_node, files removed from the table are put once
+	 * every request that could have looked them up is gone.
 	 */
-	struct file		**user_files;
+	struct file __rcu	**user_files;
 	unsigned		nr_user_files;
+	unsigned		file_alloc_hint;	/* lowest maybe free slot */
+	unsigned long		*file_bitmap;
+	struct io_file_node __rcu *file_node;
 
-	/* if used, fixed mapped user buffers */
-	unsigned		nr_user_bufs;
-#define PXD_IO_MAX_USER_BUFS 16
-	struct io_mapped_ubuf   user_bufs[PXD_IO_MAX_USER_BUFS];
+	/*
+	 * If used, fixed mapped user buffers. The table is allocated on first
+	 * registration, slots are RCU protected and updated under ubuf_lock
+	 * while the ring keeps running.
+	 */
+	struct mutex		ubuf_lock;
+	unsigned		nr_user_bufs;	/* highest used slot + 1 */
+#define PXD_IO_MAX_USER_BUFS 4096
+	struct io_mapped_ubuf __rcu **user_bufs;
 
 #define PXD_IO_MAX_MSG_BUFS 4096
 	unsigned nr_msg_bufs;
 	void **msg_bufs;
+	struct io_buf_pool *buf_pool;	/* allocated on first provide */
 
 	struct completion	ctx_done;
 
@@ -126,21 +258,44 @@ struct io_ring_ctx {
 		spinlock_t		completion_lock;
 		bool			poll_multi_file;
 		/*
-		 * ->poll_list is protected by the ctx->uring_lock for
-		 * io_uring instances that don't use IORING_SETUP_SQPOLL.
-		 * For SQPOLL, only the single threaded io_sq_thread() will
-		 * manipulate the list, hence no extra locking is needed there.
+		 * ->poll_list holds issued IORING_SETUP_IOPOLL requests and
+		 * is protected by ctx->uring_lock, it is fed by the SQ
+		 * threads and the workers alike.
 		 */
 		struct list_head	poll_list;
 		struct list_head	cancel_list;
 		struct list_head	sock_poll_list;
+		/* armed IORING_OP_TIMEOUT and LINK_TIMEOUT requests */
+		struct list_head	timeout_list;
 	} ____cacheline_aligned_in_smp;
 
 	uint32_t context_id;
+	unsigned long		init_done;	/* bit 0 set by PXD_IOC_INIT_IO */
+};
+
+/*
+ * Receive buffers provided up front by the application. RECV with
+ * IOSQE_BUFFER_SELECT takes one when it runs, i.e. once data has arrived,
+ * and reports its id in the CQE flags. The application hands the buffer
+ * back with another IORING_OP_PROVIDE_BUFFERS once it consumed the data.
+ */
+#define IO_BUF_UNUSED	0
+#define IO_BUF_FREE	1
+#define IO_BUF_BUSY	2
+struct io_buf_pool {
+	spinlock_t		lock;
+	unsigned		nr_free;
+	u16			free[PXD_IO_MAX_MSG_BUFS];	/* free ids, LIFO */
+	struct {
+		u64		addr;
+		u32		len;
+		u32		state;
+	} bufs[PXD_IO_MAX_MSG_BUFS];
 };
 
 struct sqe_submit {
 	const struct io_uring_sqe	*sqe;
+	u32				sequence;
 	unsigned short			index;
 	bool				has_user;
 	bool				needs_lock;
@@ -160,6 +315,17 @@ struct io_poll_iocb {
 	struct wait_queue_entry		wait;
 };
 
+/*
+ * IORING_OP_TIMEOUT and IORING_OP_LINK_TIMEOUT. Whoever takes the request
+ * off ctx->timeout_list under completion_lock, the timer or a canceller,
+ * completes it.
+ */
+struct io_timeout {
+	struct file			*file;
+	struct hrtimer			timer;
+	struct io_kiocb			*head;	/* request bounded by a link timeout */
+};
+
 struct io_sock_poll {
 	struct file *file;
 	void (*data_ready)(struct sock *sk);
@@ -180,12 +346,14 @@ struct io_kiocb {
 		struct kiocb		rw;
 		struct io_poll_iocb	poll;
 		struct io_sock_poll	sock_poll;
+		struct io_timeout	timeout;
 	};
 
 	struct sqe_submit	submit;
 
 	struct io_ring_ctx	*ctx;
 	struct list_head	list;
+	struct list_head	link_list;	/* rest of the chain, if REQ_F_LINK */
 	unsigned int		flags;
 	refcount_t		refs;
 #define REQ_F_NOWAIT		1	/* must not punt to workers */
@@ -194,17 +362,27 @@ struct io_kiocb {
 #define REQ_F_SEQ_PREV		8	/* sequential with previous */
 #define REQ_F_IO_DRAIN		16	/* drain existing IO first */
 #define REQ_F_IO_DRAINED	32	/* drain done */
+#define REQ_F_LINK		64	/* head of a chain, see link_list */
+#define REQ_F_FAIL_LINK		128	/* cancel the rest of the chain */
+#define REQ_F_IOPOLL		256	/* completion is reaped from poll_list */
 	u64			user_data;
 	u32			error;	/* iopoll result from callback */
 	u32			sequence;
 
 	struct work_struct	work;
+	u64			work_queued_ns;
+	u8			wq_class;	/* IO_WQ_* it was queued on */
+	struct io_mapped_ubuf	*imu;	/* fixed buffer, held until free */
+	struct io_file_node	*file_node;	/* pins req->file */
+	struct io_kiocb		*link_timeout;	/* armed LINK_TIMEOUT bounding us */
 };
 
 extern struct kmem_cache *req_cachep;
 
 struct io_uring_params;
 
+extern struct file_operations io_ring_fops;
+
 int io_ring_register_device(void);
 void io_ring_unregister_device(void);
 
@@ -45,6 +45,37 @@ static int _pxd_bio_discard(struct pxd_device *pxd_dev, struct file *file,
         return 0;
 }
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 12, 0)
+static int _pxd_bio_write_zeroes(struct pxd_device *pxd_dev, struct file *file,
+                                 struct bio *bio, loff_t pos) {
+        int mode = FALLOC_FL_KEEP_SIZE;
+        int ret;
+
+        atomic_inc(&pxd_dev->fp.nio_write_zeroes);
+
+        if ((!file->f_op->fallocate)) {
+                return -EOPNOTSUPP;
+        }
+
+        // keep blocks allocated if asked, else hole punch reads back zeroes
+        if (bio->bi_opf & REQ_NOUNMAP)
+                mode |= FALLOC_FL_ZERO_RANGE;
+        else
+                mode |= FALLOC_FL_PUNCH_HOLE;
+
+        ret = file->f_op->fallocate(file, mode, pos, bio->bi_iter.bi_size);
+        if (ret == -EOPNOTSUPP && (mode & FALLOC_FL_ZERO_RANGE)) {
+                mode = FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE;
+                ret = file->f_op->fallocate(file, mode, pos,
+                                            bio->bi_iter.bi_size);
+        }
+        if (unlikely(ret && ret != -EINVAL && ret != -EOPNOTSUPP))
+                return -EIO;
+
+        return ret;
+}
+#endif
+
 static int _pxd_write(uint64_t dev_id, struct file *file, struct bio_vec *bvec,
                       loff_t *pos) {
         ssize_t bw;
@@ -245,11 +276,13 @@ int __do_bio_filebacked(struct pxd_device *pxd_dev, struct bio *bio,
                 ret = _pxd_flush(pxd_dev, file);
                 goto out;
         case REQ_OP_DISCARD:
+                ret = _pxd_bio_discard(pxd_dev, file, bio, pos);
+                goto out;
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 12, 0)
         case REQ_OP_WRITE_ZEROES:
-#endif
-                ret = _pxd_bio_discard(pxd_dev, file, bio, pos);
+                ret = _pxd_bio_write_zeroes(pxd_dev, file, bio, pos);
                 goto out;
+#endif
         default:
                 WARN_ON_ONCE(1);
                 ret = -EIO;
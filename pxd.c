@@ -11,6 +11,9 @@
 #include <linux/uio.h>
 #include <linux/bio.h>
 #include <linux/pid_namespace.h>
+#include <linux/vmalloc.h>
+#include <linux/cred.h>
+#include <linux/fs_struct.h>
 
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(5,3,0) && !defined(part_stat_lock)
 #include <linux/part_stat.h>
@@ -63,20 +66,26 @@
 extern const char *gitversion;
 static dev_t pxd_major;
 static DEFINE_IDA(pxd_minor_ida);
+static struct workqueue_struct *pxd_batch_wq;
 
 struct pxd_context *pxd_contexts;
 uint32_t pxd_num_contexts = PXD_NUM_CONTEXTS;
 uint32_t pxd_num_contexts_exported = PXD_NUM_CONTEXT_EXPORTED;
 uint32_t pxd_timeout_secs = PXD_TIMER_SECS_DEFAULT;
 uint32_t pxd_detect_zero_writes = 0;
+/* advertise write zeroes on new devices, userspace must handle PXD_WRITE_ZEROES */
+uint32_t pxd_write_zeroes = 0;
 
 module_param(pxd_num_contexts_exported, uint, 0644);
 module_param(pxd_num_contexts, uint, 0644);
 module_param(pxd_detect_zero_writes, uint, 0644);
+module_param(pxd_write_zeroes, uint, 0644);
 
 static void pxd_abort_context(struct work_struct *work);
 static int pxd_nodewipe_cleanup(struct pxd_context *ctx);
 static int pxd_bus_add_dev(struct pxd_device *pxd_dev);
+static ssize_t __pxd_read_init(struct pxd_context *ctx, struct iov_iter *iter,
+		uint64_t *generation, bool *changed);
 
 struct pxd_context* find_context(unsigned ctx)
 {
@@ -185,6 +194,34 @@ static long pxd_ioctl_init(struct file *file, void __user *argp)
 	return pxd_read_init(&ctx->fc, &iter);
 }
 
+static long pxd_ioctl_init_gen(struct file *file, void __user *argp)
+{
+	struct pxd_context *ctx = container_of(file->f_op, struct pxd_context, fops);
+	struct pxd_ioctl_init_gen_args __user *args = argp;
+	struct iov_iter iter;
+	struct iovec iov = {&args->init, sizeof(struct pxd_ioctl_init_args)};
+	uint64_t generation;
+	bool changed;
+	ssize_t ret;
+	uint32_t out;
+
+	if (copy_from_user(&generation, &args->generation, sizeof(generation)))
+		return -EFAULT;
+
+	iov_iter_init(&iter, WRITE, &iov, 1, sizeof(struct pxd_ioctl_init_args));
+
+	ret = __pxd_read_init(ctx, &iter, &generation, &changed);
+	if (ret < 0)
+		return ret;
+
+	out = changed;
+	if (copy_to_user(&args->generation, &generation, sizeof(generation)) ||
+	    copy_to_user(&args->changed, &out, sizeof(out)))
+		return -EFAULT;
+
+	return ret;
+}
+
 static long pxd_ioctl_resize(struct file *file, void __user *argp)
 {
 	struct pxd_context *ctx = NULL;
@@ -351,6 +388,8 @@ static long pxd_control_ioctl(struct file *file, unsigned int cmd, unsigned long
 		return pxd_ioctl_get_version((void __user *)arg);
 	case PXD_IOC_INIT:
 		return pxd_ioctl_init(file, (void __user *)arg);
+	case PXD_IOC_INIT_GEN:
+		return pxd_ioctl_init_gen(file, (void __user *)arg);
 	case PXD_IOC_RUN_USER_QUEUE:
 		return -ENOTTY;
 	case PXD_IOC_RESIZE:
@@ -581,6 +620,10 @@ static void pxd_req_misc(struct fuse_req *req, uint32_t size, uint64_t off,
 		((flags & REQ_FUA) ? PXD_FLAGS_FUA : 0) |
 		((flags & REQ_PREFLUSH) ? PXD_FLAGS_PREFLUSH : 0) |
 		((flags & REQ_META) ? PXD_FLAGS_META : 0);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,10,0)
+	if (flags & REQ_NOUNMAP)
+		req->pxd_rdwr_in.flags |= PXD_FLAGS_NOUNMAP;
+#endif
 #else
 	req->pxd_rdwr_in.flags = ((flags & REQ_FLUSH) ? PXD_FLAGS_PREFLUSH : 0) |
 					  ((flags & REQ_FUA) ? PXD_FLAGS_FUA : 0) |
@@ -757,6 +800,29 @@ static int pxd_write_same_request(struct fuse_req *req, uint32_t size, uint64_t
 	return 0;
 }
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,10,0)
+static int pxd_write_zeroes_request(struct fuse_req *req, uint32_t size, uint64_t off,
+			uint32_t minor, uint32_t flags)
+{
+	int rc;
+
+	rc = pxd_handle_device_limits(req, &size, &off, REQ_OP_WRITE_ZEROES);
+	if (rc) {
+		return rc;
+	}
+
+	req->in.opcode = PXD_WRITE_ZEROES;
+#ifdef __PXD_BIO_MAKEREQ__
+	req->end = pxd_process_write_reply;
+#else
+	req->end = pxd_process_write_reply_q;
+#endif
+
+	pxd_req_misc(req, size, off, minor, flags);
+	return 0;
+}
+#endif
+
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(4,8,0) || defined(REQ_PREFLUSH)
 static int pxd_request(struct fuse_req *req, uint32_t size, uint64_t off,
 			uint32_t minor, uint32_t op, uint32_t flags)
@@ -777,6 +843,11 @@ static int pxd_request(struct fuse_req *req, uint32_t size, uint64_t off,
 	case REQ_OP_DISCARD:
 		rc = pxd_discard_request(req, size, off, minor, flags);
 		break;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,10,0)
+	case REQ_OP_WRITE_ZEROES:
+		rc = pxd_write_zeroes_request(req, size, off, minor, flags);
+		break;
+#endif
 	case REQ_OP_FLUSH:
 		rc = pxd_write_request(req, 0, 0, minor, REQ_FUA);
 		break;
@@ -1254,25 +1325,30 @@ static int pxd_init_disk(struct pxd_device *pxd_dev)
 	disk->private_data = pxd_dev;
 	set_capacity(disk, pxd_dev->size / SECTOR_SIZE);
 
-	blk_queue_max_hw_sectors(q, SEGMENT_SIZE / SECTOR_SIZE);
-	blk_queue_max_segment_size(q, SEGMENT_SIZE);
-	blk_queue_max_segments(q, (SEGMENT_SIZE / PXD_LBS));
+	blk_queue_max_hw_sectors(q, pxd_dev->max_io_size / SECTOR_SIZE);
+	blk_queue_max_segment_size(q, pxd_dev->max_io_size);
+	blk_queue_max_segments(q, pxd_dev->max_segments);
 	blk_queue_io_min(q, PXD_LBS);
-	blk_queue_io_opt(q, PXD_LBS);
+	blk_queue_io_opt(q, pxd_dev->io_opt);
 	blk_queue_logical_block_size(q, PXD_LBS);
 	blk_queue_physical_block_size(q, PXD_LBS);
 
 	/* Enable discard support. */
 	QUEUE_FLAG_SET(QUEUE_FLAG_DISCARD,q);
 
-    q->limits.discard_granularity = PXD_MAX_DISCARD_GRANULARITY;
-    q->limits.discard_alignment = PXD_MAX_DISCARD_GRANULARITY;
+    q->limits.discard_granularity = pxd_dev->discard_granularity;
+    q->limits.discard_alignment = pxd_dev->discard_granularity;
     q->limits.max_discard_sectors = pxd_dev->discard_size / SECTOR_SIZE;
 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(4,12,0)
 	q->limits.discard_zeroes_data = 1;
 #endif
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,10,0)
+	blk_queue_max_write_zeroes_sectors(q,
+		pxd_write_zeroes ? pxd_dev->discard_size / SECTOR_SIZE : 0);
+#endif
+
 	/* Enable flush support. */
 	BLK_QUEUE_FLUSH(q);
 
@@ -1353,7 +1429,54 @@ static lookup_bdev_wrapper_fn lookup_bdev_wrapper = (lookup_bdev_wrapper_fn)look
 #endif
 
 static int __pxd_update_path(struct pxd_device *pxd_dev, struct pxd_update_path_out *update_path);
-ssize_t pxd_add(struct fuse_conn *fc, struct pxd_add_ext_out *add)
+
+static int pxd_set_io_geometry(struct pxd_device *pxd_dev,
+		struct pxd_add_ext_out *add)
+{
+	pxd_dev->max_io_size = add->max_io_size ? add->max_io_size : SEGMENT_SIZE;
+	if (pxd_dev->max_io_size > PXD_MAX_IO ||
+	    !IS_ALIGNED(pxd_dev->max_io_size, PXD_LBS)) {
+		printk(KERN_ERR "device %llu invalid max io size %u\n",
+			add->dev_id, add->max_io_size);
+		return -EINVAL;
+	}
+
+	pxd_dev->max_segments = add->max_segments ? add->max_segments :
+		pxd_dev->max_io_size / PXD_LBS;
+	if (pxd_dev->max_segments > USHRT_MAX) {
+		printk(KERN_ERR "device %llu invalid max segments %u\n",
+			add->dev_id, add->max_segments);
+		return -EINVAL;
+	}
+
+	pxd_dev->io_opt = add->io_opt ? add->io_opt : PXD_LBS;
+	if (pxd_dev->io_opt > pxd_dev->max_io_size ||
+	    !IS_ALIGNED(pxd_dev->io_opt, PXD_LBS)) {
+		printk(KERN_ERR "device %llu invalid optimal io size %u\n",
+			add->dev_id, add->io_opt);
+		return -EINVAL;
+	}
+
+	pxd_dev->discard_granularity = add->discard_granularity ?
+		add->discard_granularity : PXD_MAX_DISCARD_GRANULARITY;
+	if (!is_power_of_2(pxd_dev->discard_granularity) ||
+	    pxd_dev->discard_granularity < PXD_MIN_DISCARD_GRANULARITY ||
+	    pxd_dev->discard_granularity > max_t(unsigned int,
+			pxd_dev->discard_size, PXD_MAX_DISCARD_GRANULARITY)) {
+		printk(KERN_ERR "device %llu invalid discard granularity %u\n",
+			add->dev_id, add->discard_granularity);
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+/*
+ * Backing paths of a fastpath device are looked up under root, if given,
+ * instead of the root of the current task.
+ */
+static ssize_t __pxd_add(struct fuse_conn *fc, struct pxd_add_ext_out *add,
+		const struct path *root)
 {
 	struct pxd_context *ctx = container_of(fc, struct pxd_context, fc);
 	struct pxd_device *pxd_dev = NULL;
@@ -1371,7 +1494,9 @@ ssize_t pxd_add(struct fuse_conn *fc, struct pxd_add_ext_out *add)
 	pxd_dev = find_pxd_device(ctx, add->dev_id);
 	if (pxd_dev) {
 		if (add->enable_fp && add->paths.count > 0) {
+			pxd_dev->fp.open_root = root;
 			__pxd_update_path(pxd_dev, &add->paths);
+			pxd_dev->fp.open_root = NULL;
 		} else {
 			disableFastPath(pxd_dev, false);
 		}
@@ -1412,14 +1537,35 @@ ssize_t pxd_add(struct fuse_conn *fc, struct pxd_add_ext_out *add)
 		goto out_module;
 	}
 
+	if (add->flags & ~PXD_ADD_FLAGS_CHECKSUM) {
+		printk(KERN_ERR "device %llu invalid flags %#x\n",
+			add->dev_id, add->flags);
+		err = -EINVAL;
+		goto out_id;
+	}
+	pxd_dev->checksum = !!(add->flags & PXD_ADD_FLAGS_CHECKSUM);
+	if (pxd_dev->checksum && add->enable_fp) {
+		/* fastpath io never passes through userspace copies */
+		printk(KERN_ERR "device %llu checksum not supported with fastpath\n",
+			add->dev_id);
+		err = -EOPNOTSUPP;
+		goto out_id;
+	}
+	atomic64_set(&pxd_dev->nr_csum_errors, 0);
+
 	if (add->discard_size < SECTOR_SIZE)
 		pxd_dev->discard_size = SEGMENT_SIZE;
 	else
 		pxd_dev->discard_size = add->discard_size;
 
+	err = pxd_set_io_geometry(pxd_dev, add);
+	if (err)
+		goto out_id;
+
 	// congestion init
 	init_waitqueue_head(&pxd_dev->suspend_wq);
 	init_waitqueue_head(&pxd_dev->remove_wait);
+	init_waitqueue_head(&pxd_dev->resume_wait);
 	// hard coded congestion limits within driver
 	atomic_set(&pxd_dev->congested, 0);
 	pxd_dev->qdepth = DEFAULT_CONGESTION_THRESHOLD;
@@ -1436,7 +1582,9 @@ ssize_t pxd_add(struct fuse_conn *fc, struct pxd_add_ext_out *add)
 		goto out_id;
 
 	if (fastpath_enabled(pxd_dev)) {
+		pxd_dev->fp.open_root = root;
 		err = pxd_init_fastpath_target(pxd_dev, &add->paths);
+		pxd_dev->fp.open_root = NULL;
 		if (err) {
 			pxd_fastpath_cleanup(pxd_dev);
 			goto out_id;
@@ -1444,20 +1592,29 @@ ssize_t pxd_add(struct fuse_conn *fc, struct pxd_add_ext_out *add)
 	}
 
 	spin_lock(&ctx->lock);
+	if (ctx->num_devices >= PXD_MAX_DEVICES) {
+		err = -ENOMEM;
+		spin_unlock(&ctx->lock);
+		printk(KERN_ERR "Too many devices attached..\n");
+		goto out_fp;
+	}
 	list_for_each_entry(pxd_dev_itr, &ctx->list, node) {
 		if (pxd_dev_itr->dev_id == add->dev_id) {
 			err = -EEXIST;
 			spin_unlock(&ctx->lock);
-			goto out_id;
+			goto out_fp;
 		}
 	}
 
 	list_add(&pxd_dev->node, &ctx->list);
 	++ctx->num_devices;
+	++ctx->generation;
 	spin_unlock(&ctx->lock);
 
 	return pxd_dev->minor | (fastpath_active(pxd_dev) << MINORBITS);
 
+out_fp:
+	pxd_fastpath_cleanup(pxd_dev);
 out_id:
 	ida_simple_remove(&pxd_minor_ida, new_minor);
 out_module:
@@ -1467,16 +1624,54 @@ out_module:
 	return err;
 }
 
-ssize_t pxd_export(struct fuse_conn *fc, uint64_t dev_id)
+ssize_t pxd_add(struct fuse_conn *fc, struct pxd_add_ext_out *add)
+{
+	return __pxd_add(fc, add, NULL);
+}
+
+/*
+ * Keep __pxd_read_init() from pinning the device for a resume and wait for
+ * the resumes it already runs, before the disk and the device go away.
+ */
+static void pxd_resume_fence(struct pxd_device *pxd_dev)
+{
+	spin_lock(&pxd_dev->lock);
+	pxd_dev->removing = true;
+	spin_unlock(&pxd_dev->lock);
+
+	wait_event(pxd_dev->resume_wait, !READ_ONCE(pxd_dev->resume_pins));
+}
+
+/*
+ * Detect a prior instance of the device that is not removed yet. The device
+ * node is looked up by path, so this must run in the context of the caller.
+ */
+static bool pxd_bdev_stale(uint64_t dev_id)
 {
-	struct pxd_context *ctx = container_of(fc, struct pxd_context, fc);
-	struct pxd_device *pxd_dev = find_pxd_device(ctx, dev_id);
 	char devfile[128];
 #if LINUX_VERSION_CODE < KERNEL_VERSION(5,11,0)
 	struct block_device *bdev;
 #else
 	dev_t kdev;
 #endif
+
+	sprintf(devfile, "/dev/pxd/pxd%llu", dev_id);
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5,11,0)
+	bdev = lookup_bdev_wrapper(devfile, 0);
+	if (IS_ERR(bdev))
+		return false;
+	bdput(bdev);
+#else
+	if (lookup_bdev(devfile, &kdev))
+		return false;
+#endif
+	return true;
+}
+
+static ssize_t __pxd_export(struct fuse_conn *fc, uint64_t dev_id, bool stale)
+{
+	struct pxd_context *ctx = container_of(fc, struct pxd_context, fc);
+	struct pxd_device *pxd_dev = find_pxd_device(ctx, dev_id);
 	int err = 0;
 
 	if (pxd_dev) {
@@ -1486,26 +1681,12 @@ ssize_t pxd_export(struct fuse_conn *fc, uint64_t dev_id)
 			return 0;
 		}
 
-        /* pre-check to detect if prior instance is removed */
-        sprintf(devfile, "/dev/pxd/pxd%llu", pxd_dev->dev_id);
-#if LINUX_VERSION_CODE < KERNEL_VERSION(5,11,0)
-        bdev = lookup_bdev_wrapper(devfile, 0);
-        if (!IS_ERR(bdev)) {
-            spin_unlock(&pxd_dev->lock);
-            bdput(bdev);
-            pr_err("stale bdev %s still alive", devfile);
-            err = -EEXIST;
-            goto cleanup;
-        }
-#else
-        err = lookup_bdev(devfile, &kdev);
-        if (!err) {
+        if (stale) {
             spin_unlock(&pxd_dev->lock);
-            pr_err("stale bdev %s still alive", devfile);
+            pr_err("stale bdev /dev/pxd/pxd%llu still alive", dev_id);
             err = -EEXIST;
             goto cleanup;
         }
-#endif
 
         if (!try_module_get(THIS_MODULE)) {
             spin_unlock(&pxd_dev->lock);
@@ -1523,6 +1704,7 @@ ssize_t pxd_export(struct fuse_conn *fc, uint64_t dev_id)
         spin_unlock(&pxd_dev->lock);
         err = pxd_bus_add_dev(pxd_dev);
         if (err) {
+            pxd_resume_fence(pxd_dev);
             pxd_free_disk(pxd_dev);
             module_put(THIS_MODULE);
             goto cleanup;
@@ -1531,6 +1713,7 @@ ssize_t pxd_export(struct fuse_conn *fc, uint64_t dev_id)
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(5,15,0)
 		err = add_disk(pxd_dev->disk);
         if (err) {
+            pxd_resume_fence(pxd_dev);
             device_unregister(&pxd_dev->dev);
             pxd_free_disk(pxd_dev);
             module_put(THIS_MODULE);
@@ -1554,10 +1737,12 @@ ssize_t pxd_export(struct fuse_conn *fc, uint64_t dev_id)
 
 	return -ENOENT;
 cleanup:
+    pxd_resume_fence(pxd_dev);
     spin_lock(&ctx->lock);
     spin_lock(&pxd_dev->lock);
     list_del(&pxd_dev->node);
     --ctx->num_devices;
+    ++ctx->generation;
     ida_simple_remove(&pxd_minor_ida, pxd_dev->minor);
     spin_unlock(&pxd_dev->lock);
     spin_unlock(&ctx->lock);
@@ -1567,12 +1752,18 @@ cleanup:
     return err;
 }
 
+ssize_t pxd_export(struct fuse_conn *fc, uint64_t dev_id)
+{
+	return __pxd_export(fc, dev_id, pxd_bdev_stale(dev_id));
+}
+
 static void pxd_finish_remove(struct work_struct *work)
 {
 	struct pxd_device *pxd_dev = container_of(work, struct pxd_device, remove_work);
 
 	pr_info("%s: dev %llu\n", __func__, pxd_dev->dev_id);
 
+	pxd_resume_fence(pxd_dev);
 	pxd_fastpath_reset_device(pxd_dev);
 
 	/* Make sure the req_fn isn't called anymore even if the device hangs around */
@@ -1601,6 +1792,7 @@ static void pxd_finish_remove(struct work_struct *work)
 	spin_lock(&pxd_dev->ctx->lock);
 	spin_lock(&pxd_dev->lock);
 	--pxd_dev->ctx->num_devices;
+	++pxd_dev->ctx->generation;
 	pxd_dev->exported = false;
 	list_del(&pxd_dev->node);
 	wake_up_all(&pxd_dev->remove_wait);
@@ -1665,6 +1857,191 @@ out:
 	return err;
 }
 
+/*
+ * State of one PXD_BATCH, shared by the caller and the work items. The
+ * caller may be killed while they run, the last reference frees it.
+ */
+struct pxd_batch_ctx {
+	struct fuse_conn *fc;
+	struct pxd_batch_out batch;
+	struct path root;		/* of the caller, for the backing paths */
+	const struct cred *cred;	/* of the caller */
+	struct pxd_add_ext_out *devs;
+	struct pxd_batch_work *works;
+	atomic_t refs;			/* caller and queued work items */
+	atomic_t pending;		/* queued work items still running */
+	struct completion done;
+};
+
+struct pxd_batch_work {
+	struct work_struct work;
+	struct pxd_batch_ctx *bc;
+	struct pxd_add_ext_out *add;
+	bool stale;		/* device node checked by the caller */
+	int64_t result;
+};
+
+static void pxd_batch_put(struct pxd_batch_ctx *bc)
+{
+	if (!atomic_dec_and_test(&bc->refs))
+		return;
+
+	path_put(&bc->root);
+	put_cred(bc->cred);
+	vfree(bc->works);
+	vfree(bc->devs);
+	kfree(bc);
+}
+
+static void pxd_batch_fn(struct work_struct *work)
+{
+	struct pxd_batch_work *bw = container_of(work, struct pxd_batch_work, work);
+	struct pxd_batch_ctx *bc = bw->bc;
+	struct pxd_remove_out remove;
+	const struct cred *old_cred;
+	ssize_t ret, err;
+
+	switch (bc->batch.op) {
+	case PXD_ADD_EXT:
+		old_cred = override_creds(bc->cred);
+		ret = __pxd_add(bc->fc, bw->add, &bc->root);
+		revert_creds(old_cred);
+		if (ret >= 0 && bc->batch.do_export) {
+			err = __pxd_export(bc->fc, bw->add->dev_id, bw->stale);
+			if (err)
+				ret = err;
+		}
+		break;
+	case PXD_EXPORT_DEV:
+		ret = __pxd_export(bc->fc, bw->add->dev_id, bw->stale);
+		break;
+	case PXD_REMOVE:
+		memset(&remove, 0, sizeof(remove));
+		remove.dev_id = bw->add->dev_id;
+		remove.force = bc->batch.force;
+		ret = pxd_remove(bc->fc, &remove);
+		break;
+	default:
+		ret = -EINVAL;
+		break;
+	}
+
+	bw->result = ret;
+	if (atomic_dec_and_test(&bc->pending))
+		complete(&bc->done);
+	pxd_batch_put(bc);
+}
+
+/*
+ * Process a batch of devices, each on its own work item so that the
+ * allocations, the backing file opens, tag set allocation and add_disk for
+ * different devices proceed in parallel. The work items run with the
+ * caller's credentials and resolve backing paths under the caller's root,
+ * and the stale device node check is done here, so paths are seen the way
+ * the caller sees them rather than from the worker's namespace.
+ * Duplicate device ids within a batch are rejected as the single device
+ * operations are not safe to race against themselves.
+ */
+ssize_t pxd_batch(struct fuse_conn *fc, struct pxd_batch_out *batch,
+		struct iov_iter *iter)
+{
+	struct pxd_batch_ctx *bc;
+	struct pxd_add_ext_out *devs;
+	struct pxd_batch_work *works;
+	int64_t *results = NULL;
+	size_t len = batch->entry_size;
+	ssize_t err;
+	int i, j, nfailed = 0;
+
+	switch (batch->op) {
+	case PXD_ADD_EXT:
+	case PXD_EXPORT_DEV:
+	case PXD_REMOVE:
+		break;
+	default:
+		printk(KERN_ERR "%s: unsupported batch op %u\n", __func__, batch->op);
+		return -EINVAL;
+	}
+
+	bc = kzalloc(sizeof(*bc), GFP_KERNEL);
+	if (!bc)
+		return -ENOMEM;
+	bc->fc = fc;
+	bc->batch = *batch;
+	get_fs_root(current->fs, &bc->root);
+	bc->cred = get_current_cred();
+	/* one reference and one pending count held until all work is queued */
+	atomic_set(&bc->refs, 1);
+	atomic_set(&bc->pending, 1);
+	init_completion(&bc->done);
+
+	err = -ENOMEM;
+	/* zeroed, fields missing from older entries take the defaults */
+	devs = bc->devs = vzalloc(batch->count * sizeof(*devs));
+	works = bc->works = vmalloc(batch->count * sizeof(*works));
+	results = vmalloc(batch->count * sizeof(*results));
+	if (!devs || !works || !results)
+		goto out;
+
+	for (i = 0; i < batch->count; i++) {
+		if (copy_from_iter(&devs[i], len, iter) != len) {
+			printk(KERN_ERR "%s: can't copy devices\n", __func__);
+			err = -EFAULT;
+			goto out;
+		}
+	}
+
+	for (i = 0; i < batch->count; i++) {
+		for (j = 0; j < i; j++) {
+			if (devs[j].dev_id == devs[i].dev_id)
+				break;
+		}
+		if (j != i) {
+			printk(KERN_ERR "%s: duplicate device %llu in batch\n",
+				__func__, devs[i].dev_id);
+			works[i].result = -EINVAL;
+			continue;
+		}
+
+		INIT_WORK(&works[i].work, pxd_batch_fn);
+		works[i].bc = bc;
+		works[i].add = &devs[i];
+		works[i].result = 0;
+		works[i].stale = batch->op == PXD_EXPORT_DEV ||
+			(batch->op == PXD_ADD_EXT && batch->do_export);
+		if (works[i].stale)
+			works[i].stale = pxd_bdev_stale(devs[i].dev_id);
+		atomic_inc(&bc->refs);
+		atomic_inc(&bc->pending);
+		queue_work(pxd_batch_wq, &works[i].work);
+	}
+
+	if (!atomic_dec_and_test(&bc->pending) &&
+	    wait_for_completion_killable(&bc->done)) {
+		/* the work items finish on their own and drop the batch */
+		err = -EINTR;
+		goto out;
+	}
+
+	for (i = 0; i < batch->count; i++) {
+		results[i] = works[i].result;
+		if (results[i] < 0)
+			nfailed++;
+	}
+
+	printk(KERN_INFO "%s: op %u on %u devices, %d failed\n", __func__,
+		batch->op, batch->count, nfailed);
+
+	err = 0;
+	if (copy_to_user(u64_to_user_ptr(batch->results), results,
+			batch->count * sizeof(*results)))
+		err = -EFAULT;
+out:
+	vfree(results);
+	pxd_batch_put(bc);
+	return err;
+}
+
 ssize_t pxd_update_size(struct fuse_conn *fc, struct pxd_update_size *update_size)
 {
 	return -EOPNOTSUPP;
@@ -1723,59 +2100,123 @@ out:
 	return err;
 }
 
-ssize_t pxd_read_init(struct fuse_conn *fc, struct iov_iter *iter)
+/*
+ * Device list snapshot for PXD_IOC_INIT. Only plain copies happen under
+ * ctx->lock; user copies and resuming IO on app suspended devices, which
+ * unfreezes the queue and can sleep, are done after the lock is dropped.
+ * Devices being resumed are pinned through ->resume_pins, removal and a
+ * failed export wait for them in pxd_resume_fence().
+ */
+static ssize_t __pxd_read_init(struct pxd_context *ctx, struct iov_iter *iter,
+		uint64_t *generation, bool *changed)
 {
 	size_t copied = 0;
-	struct pxd_context *ctx = container_of(fc, struct pxd_context, fc);
 	struct pxd_device *pxd_dev;
 	struct pxd_init_in pxd_init;
+	struct pxd_dev_id *ids;
+	struct pxd_device **resume;
+	int i, nresume = 0;
+	ssize_t ret = -EFAULT;
+
+	ids = kcalloc(PXD_MAX_DEVICES, sizeof(*ids), GFP_KERNEL);
+	resume = kcalloc(PXD_MAX_DEVICES, sizeof(*resume), GFP_KERNEL);
+	if (!ids || !resume) {
+		ret = -ENOMEM;
+		goto out;
+	}
 
-	spin_lock(&ctx->lock);
-
-	pxd_init.num_devices = ctx->num_devices;
+	pxd_init.num_devices = 0;
 	pxd_init.version = PXD_VERSION;
 
-	if (copy_to_iter(&pxd_init, sizeof(pxd_init), iter) != sizeof(pxd_init)) {
-		printk(KERN_ERR "%s: copy pxd_init error\n", __func__);
-		goto copy_error;
+	spin_lock(&ctx->lock);
+	if (generation) {
+		*changed = (*generation != ctx->generation);
+		*generation = ctx->generation;
 	}
-	copied += sizeof(pxd_init);
 
 	list_for_each_entry(pxd_dev, &ctx->list, node) {
-		struct pxd_dev_id id = {0}; // initialize all fields to zero
-		id.dev_id = pxd_dev->dev_id;
-		id.local_minor = pxd_dev->minor;
-		id.fastpath = 0;
+		struct pxd_dev_id *id = &ids[pxd_init.num_devices];
+
+		if (pxd_init.num_devices == PXD_MAX_DEVICES) {
+			printk(KERN_ERR "%s: too many devices\n", __func__);
+			break;
+		}
+
+		id->dev_id = pxd_dev->dev_id;
+		id->local_minor = pxd_dev->minor;
+		id->fastpath = pxd_dev->fp.fastpath ? 1 : 0;
 #ifdef __PXD_BIO_MAKEREQ__
-		id.blkmq_device = 0;
+		id->blkmq_device = 0;
 #else
-		id.blkmq_device = 1;
+		id->blkmq_device = 1;
 #endif
-		id.suspend = 0;
+		id->suspend = 0;
+		pxd_init.num_devices++;
+
 		// resume from userspace IO suspends after px restarts
-		pxd_request_resume(pxd_dev);
-		if (pxd_dev->fp.fastpath) id.fastpath = 1;
-		BUG_ON(atomic_read(&pxd_dev->fp.app_suspend));
-		if (copy_to_iter(&id, sizeof(id), iter) != sizeof(id)) {
-			printk(KERN_ERR "%s: copy dev id error copied %ld\n", __func__,
-				copied);
-			goto copy_error;
+		spin_lock(&pxd_dev->lock);
+		if (!pxd_dev->removing &&
+		    atomic_cmpxchg(&pxd_dev->fp.app_suspend, 1, 0) == 1) {
+			pxd_dev->resume_pins++;
+			resume[nresume++] = pxd_dev;
 		}
-		copied += sizeof(id);
+		spin_unlock(&pxd_dev->lock);
 	}
-
 	spin_unlock(&ctx->lock);
 
-	printk(KERN_INFO "%s: pxd-control-%d init OK %d devs version %d\n", __func__,
-		ctx->id, pxd_init.num_devices, pxd_init.version);
+	for (i = 0; i < nresume; i++) {
+		int rc;
 
-	return copied;
+		pxd_dev = resume[i];
+		rc = pxd_request_resume_internal(pxd_dev);
+		if (rc) {
+			atomic_set(&pxd_dev->fp.app_suspend, 1);
+			printk(KERN_ERR "%s: device %llu resume failed %d\n",
+				__func__, pxd_dev->dev_id, rc);
+		}
 
-copy_error:
-	spin_unlock(&ctx->lock);
-	return -EFAULT;
+		/* the waiter frees the device only after taking the lock */
+		spin_lock(&pxd_dev->lock);
+		if (!--pxd_dev->resume_pins)
+			wake_up(&pxd_dev->resume_wait);
+		spin_unlock(&pxd_dev->lock);
+	}
+
+	if (copy_to_iter(&pxd_init, sizeof(pxd_init), iter) != sizeof(pxd_init)) {
+		printk(KERN_ERR "%s: copy pxd_init error\n", __func__);
+		goto out;
+	}
+	copied += sizeof(pxd_init);
+
+	/* device list unchanged since the caller's generation, skip it */
+	if (generation && !*changed)
+		goto done;
+
+	for (i = 0; i < pxd_init.num_devices; i++) {
+		if (copy_to_iter(&ids[i], sizeof(ids[i]), iter) != sizeof(ids[i])) {
+			printk(KERN_ERR "%s: copy dev id error copied %ld\n", __func__,
+				copied);
+			goto out;
+		}
+		copied += sizeof(ids[i]);
+	}
+
+done:
+	printk(KERN_INFO "%s: pxd-control-%d init OK %d devs version %d resumed %d\n",
+		__func__, ctx->id, pxd_init.num_devices, pxd_init.version, nresume);
+	ret = copied;
+out:
+	kfree(resume);
+	kfree(ids);
+	return ret;
 }
 
+ssize_t pxd_read_init(struct fuse_conn *fc, struct iov_iter *iter)
+{
+	struct pxd_context *ctx = container_of(fc, struct pxd_context, fc);
+
+	return __pxd_read_init(ctx, iter, NULL, NULL);
+}
 
 static int __pxd_update_path(struct pxd_device *pxd_dev, struct pxd_update_path_out *update_path)
 {
@@ -1906,12 +2347,13 @@ static ssize_t pxd_active_show(struct device *dev,
 	int available = PAGE_SIZE - 1;
 	int i;
 
-	ncount = snprintf(cp, available, "active/complete: %u/%u, failed: %u, [write: %u, flush: %u(nop: %u), fua: %u, discard: %u, preflush: %u], switched: %u, slowpath: %u\n",
+	ncount = snprintf(cp, available, "active/complete: %u/%u, failed: %u, [write: %u, flush: %u(nop: %u), fua: %u, discard: %u, write zeroes: %u, preflush: %u], switched: %u, slowpath: %u\n",
                 atomic_read(&pxd_dev->ncount), atomic_read(&pxd_dev->fp.ncomplete),
 		atomic_read(&pxd_dev->fp.nerror),
 		atomic_read(&pxd_dev->fp.nio_write),
 		atomic_read(&pxd_dev->fp.nio_flush), atomic_read(&pxd_dev->fp.nio_flush_nop),
 		atomic_read(&pxd_dev->fp.nio_fua), atomic_read(&pxd_dev->fp.nio_discard),
+		atomic_read(&pxd_dev->fp.nio_write_zeroes),
 		atomic_read(&pxd_dev->fp.nio_preflush),
 		atomic_read(&pxd_dev->fp.nswitch), atomic_read(&pxd_dev->fp.nslowPath));
 
@@ -2152,6 +2594,23 @@ static ssize_t pxd_inprogress_show(struct device *dev,
 	return sprintf(buf, "%d", atomic_read(&pxd_dev->ncount));
 }
 
+static ssize_t pxd_checksum_show(struct device *dev,
+                     struct device_attribute *attr, char *buf)
+{
+	struct pxd_device *pxd_dev = dev_to_pxd_dev(dev);
+
+	return sprintf(buf, "%d", pxd_dev->checksum);
+}
+
+static ssize_t pxd_checksum_errors_show(struct device *dev,
+                     struct device_attribute *attr, char *buf)
+{
+	struct pxd_device *pxd_dev = dev_to_pxd_dev(dev);
+
+	return sprintf(buf, "%lld",
+			(long long)atomic64_read(&pxd_dev->nr_csum_errors));
+}
+
 static int pxd_nodewipe_cleanup(struct pxd_context *ctx)
 {
 	struct list_head *cur;
@@ -2212,6 +2671,8 @@ static DEVICE_ATTR(mode, S_IRUGO, pxd_mode_show, NULL);
 static DEVICE_ATTR(debug, S_IRUGO|S_IWUSR, pxd_debug_show, pxd_debug_store);
 static DEVICE_ATTR(inprogress, S_IRUGO, pxd_inprogress_show, NULL);
 static DEVICE_ATTR(release, S_IWUSR, NULL, pxd_release_store);
+static DEVICE_ATTR(checksum, S_IRUGO, pxd_checksum_show, NULL);
+static DEVICE_ATTR(checksum_errors, S_IRUGO, pxd_checksum_errors_show, NULL);
 
 static struct attribute *pxd_attrs[] = {
 	&dev_attr_size.attr,
@@ -2225,6 +2686,8 @@ static struct attribute *pxd_attrs[] = {
 	&dev_attr_debug.attr,
 	&dev_attr_inprogress.attr,
 	&dev_attr_release.attr,
+	&dev_attr_checksum.attr,
+	&dev_attr_checksum_errors.attr,
 	NULL
 };
 
@@ -2531,12 +2994,19 @@ int pxd_init(void)
 		goto out;
 	}
 
+	err = -ENOMEM;
+	pxd_batch_wq = alloc_workqueue("pxd-batch", WQ_UNBOUND, 0);
+	if (!pxd_batch_wq) {
+		printk(KERN_ERR "pxd: failed to allocate batch workqueue\n");
+		goto out_fuse_dev;
+	}
+
 	pxd_contexts = kzalloc(sizeof(pxd_contexts[0]) * pxd_num_contexts,
 		GFP_KERNEL);
 	err = -ENOMEM;
 	if (!pxd_contexts) {
 		printk(KERN_ERR "pxd: failed to allocate memory\n");
-		goto out_fuse_dev;
+		goto out_batch_wq;
 	}
 
 	for (i = 0; i < pxd_num_contexts; ++i) {
@@ -2599,6 +3069,8 @@ out_fuse:
 		pxd_context_destroy(&pxd_contexts[j]);
 	}
 	kfree(pxd_contexts);
+out_batch_wq:
+	destroy_workqueue(pxd_batch_wq);
 out_fuse_dev:
 	fuse_dev_cleanup();
 out:
@@ -2627,6 +3099,7 @@ void pxd_exit(void)
 	fuse_dev_cleanup();
 
 	kfree(pxd_contexts);
+	destroy_workqueue(pxd_batch_wq);
 
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(4,15,0)
 	kmem_cache_destroy(req_cachep);
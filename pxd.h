@@ -9,6 +9,7 @@
 #include <stdint.h>
 #include <sys/param.h>
 #include <string.h>
+#include <stddef.h>
 
 // definitions needed for userspace
 // ref: include/linux/kdev_t.h
@@ -49,6 +50,12 @@
 #define PXD_IOC_REGISTER_REGION	_IO(PXD_IOCTL_MAGIC, 15)
 #define PXD_IOC_GIVE_BUFFERS	_IO(PXD_IOCTL_MAGIC, 16)
 #define PXD_IOC_FREE_BUFFERS	_IO(PXD_IOCTL_MAGIC, 17)
+#define PXD_IOC_INIT_GEN	_IO(PXD_IOCTL_MAGIC, 18)
+#define PXD_IOC_IO_STATS	_IO(PXD_IOCTL_MAGIC, 19)
+#define PXD_IOC_IOPOLL_GETEVENTS	_IO(PXD_IOCTL_MAGIC, 20)	/* arg: min events */
+#define PXD_IOC_UNREGISTER_REGION	_IO(PXD_IOCTL_MAGIC, 21)	/* arg: buf_index */
+#define PXD_IOC_UPDATE_FILES	_IO(PXD_IOCTL_MAGIC, 22)
+#define PXD_IOC_CQ_BENCH	_IO(PXD_IOCTL_MAGIC, 23)
 
 struct pxd_ioc_register_buffers {
 	void *base;
@@ -56,6 +63,20 @@ struct pxd_ioc_register_buffers {
 	uint32_t buf_index;
 };
 
+#define PXD_FILE_INDEX_ALLOC	(-1)
+
+/**
+ * PXD_IOC_UPDATE_FILES: install count fds into the fixed file table. With
+ * offset >= 0 slot offset + i gets fds[i], an fd of -1 clears the slot.
+ * With PXD_FILE_INDEX_ALLOC every fd goes to any free slot and the slot
+ * is written back to fds[i]. Returns the number of entries done.
+ */
+struct pxd_ioc_update_files {
+	int32_t offset;
+	uint32_t count;
+	int32_t *fds;
+};
+
 struct pxd_ioc_register_region {
 	void *base;
 	size_t len;
@@ -66,6 +87,47 @@ struct pxd_ioc_give_buffers {
 	void *const *buffers; /* list of buffers to transfer to the kernel */
 };
 
+/** io context counters returned by PXD_IOC_IO_STATS */
+struct pxd_io_stats {
+	uint64_t cq_events;	/**< completions posted to the CQ ring */
+	uint64_t cq_flushes;	/**< CQ tail updates, each covering >= 1 event */
+	uint64_t cq_wakeups;	/**< wakeups of CQ waiters */
+	uint64_t sq_spin_ns;	/**< time SQ poll threads spun on an empty ring */
+	uint64_t sq_sleeps;	/**< times an SQ poll thread went to sleep */
+	uint64_t sq_wakeups;	/**< times a sleeping SQ poll thread was woken */
+	uint64_t wq_bound_depth;	/**< file/block work waiting for a worker */
+	uint64_t wq_bound_queued;	/**< file/block work punted to workers */
+	uint64_t wq_bound_wait_ns;	/**< total time file/block work waited */
+	uint64_t wq_unbound_depth;	/**< socket/poll work waiting for a worker */
+	uint64_t wq_unbound_queued;	/**< socket/poll work punted to workers */
+	uint64_t wq_unbound_wait_ns;	/**< total time socket/poll work waited */
+	uint64_t cq_backlog;	/**< completions waiting for room in the CQ ring */
+	uint64_t cq_dropped;	/**< completions lost, no memory for the backlog */
+	uint64_t cq_ev_signals;	/**< signals of the registered eventfd */
+};
+
+/**
+ * PXD_IOC_CQ_BENCH: each of nr_cpus cpus posts nr_events NOP completions to
+ * the CQ ring, burst at a time from softirq context, or from process context
+ * with PXD_CQ_BENCH_PROCESS. The caller consumes the CQ ring meanwhile, so
+ * only a ring without SQ threads that never submitted anything is accepted.
+ * Needs CAP_SYS_ADMIN and a module built with PXD_CQ_BENCH=1, -ENOTTY
+ * otherwise.
+ */
+#define PXD_CQ_BENCH_PROCESS	0x1
+#define PXD_CQ_BENCH_MAX_BURST	1024
+#define PXD_CQ_BENCH_MAX_EVENTS	(16 * 1024 * 1024)
+struct pxd_cq_bench {
+	uint32_t nr_cpus;	/**< cpus posting completions, 0 for all online */
+	uint32_t nr_events;	/**< completions posted by each cpu */
+	uint32_t burst;		/**< completions per burst */
+	uint32_t flags;		/**< PXD_CQ_BENCH_* */
+	uint64_t elapsed_ns;	/**< out: time until all were consumed */
+	uint64_t events;	/**< out: completions consumed */
+	uint64_t flushes;	/**< out: CQ tail updates */
+	uint64_t wakeups;	/**< out: wakeups of CQ waiters */
+};
+
 /* returns number of buffers returned to user space */
 struct pxd_ioc_free_buffers {
 	size_t count;	/* number of entries in buffers */
@@ -73,7 +135,8 @@ struct pxd_ioc_free_buffers {
 };
 
 #define PXD_MAX_DEVICES	512			/**< maximum number of devices supported */
-#define PXD_MAX_IO		(1024*1024)	/**< maximum io size in bytes */
+#define PXD_MAX_IO		(8*1024*1024)	/**< maximum io size in bytes */
+#define PXD_DEFAULT_IO		(1024*1024)	/**< default max io size in bytes */
 #define PXD_MAX_QDEPTH  256			/**< maximum device queue depth */
 #define PXD_MIN_DISCARD_GRANULARITY		PXD_LBS
 #define PXD_MAX_DISCARD_GRANULARITY		(64 * 1024)
@@ -114,6 +177,8 @@ enum pxd_opcode {
 	PXD_FALLBACK_TO_KERNEL,   /**< Fallback requests suspend IO and send in a marker req
 						  from kernel on a suspended device */
 	PXD_EXPORT_DEV,     /**< export the attached device to the kernel */
+	PXD_BATCH,          /**< add/export/remove a batch of devices */
+	PXD_WRITE_ZEROES,   /**< write zeroes to device range */
 	PXD_LAST,
 };
 
@@ -121,8 +186,9 @@ enum pxd_opcode {
 #define PXD_FLAGS_PREFLUSH 0x1	/**< REQ_PREFLUSH set on bio */
 #define PXD_FLAGS_FUA	0x2	/**< REQ_FUA set on bio */
 #define PXD_FLAGS_META	0x4	/**< REQ_META set on bio */
+#define PXD_FLAGS_NOUNMAP	0x8	/**< REQ_NOUNMAP set on write zeroes */
 #define PXD_FLAGS_SYNC (PXD_FLAGS_PREFLUSH | PXD_FLAGS_FUA)
-#define PXD_FLAGS_LAST PXD_FLAGS_META
+#define PXD_FLAGS_LAST PXD_FLAGS_NOUNMAP
 
 #define PXD_LBS (4 * 1024) 	/**< logical block size */
 #define PXD_LBS_MASK (PXD_LBS - 1)
@@ -185,8 +251,28 @@ struct pxd_add_ext_out {
 	mode_t  open_mode; /**< backing file open mode O_RDONLY|O_SYNC|O_DIRECT etc */
 	bool    enable_fp; /**< enable fast path */
 	struct pxd_update_path_out paths; /**< backing device paths */
+	/* io geometry, fields left zero take the driver defaults */
+	uint32_t max_io_size;	/**< max io size in bytes, upto PXD_MAX_IO */
+	uint32_t max_segments;	/**< max segments per io */
+	uint32_t io_opt;	/**< optimal io size in bytes */
+	uint32_t discard_granularity; /**< discard granularity in bytes */
+	uint32_t flags;		/**< PXD_ADD_FLAGS_* */
+	uint32_t pad;
 };
 
+/**
+ * crc32c every PXD_LBS block of the device while copying its data. Writes
+ * read with PXD_READ_DATA return the checksums in the csum array of
+ * struct pxd_read_data_csum_out. Replies to PXD_READ carry one uint32_t
+ * checksum per block after the data, the request fails with -EIO on a
+ * mismatch. Fastpath and the io ring ops that copy request data or end a
+ * read with success are refused with -EOPNOTSUPP on such devices.
+ */
+#define PXD_ADD_FLAGS_CHECKSUM	0x1
+
+/** size of PXD_ADD_EXT request before io geometry was added */
+#define PXD_ADD_EXT_OUT_V1_SIZE offsetof(struct pxd_add_ext_out, max_io_size)
+
 
 /**
  * PXD_REMOVE request from user space
@@ -197,6 +283,27 @@ struct pxd_remove_out {
 	char pad[7];
 };
 
+/**
+ * PXD_BATCH request from user space
+ *
+ * Followed by array of count struct pxd_add_ext_out, each entry_size bytes
+ * long so that userspace built against an older or newer layout is detected.
+ * Only dev_id is used for PXD_EXPORT_DEV and PXD_REMOVE. Devices in the
+ * batch are processed concurrently and the result of the equivalent single
+ * device operation is returned for each device in results. A caller killed
+ * while waiting gets -EINTR, the batch still completes but results is not
+ * written.
+ */
+struct pxd_batch_out {
+	uint32_t op;		/**< PXD_ADD_EXT, PXD_EXPORT_DEV or PXD_REMOVE */
+	uint32_t count;		/**< number of devices in the batch */
+	bool do_export;		/**< PXD_ADD_EXT: export device once added */
+	bool force;		/**< PXD_REMOVE: force remove device */
+	char pad[2];
+	uint32_t entry_size;	/**< sizeof(struct pxd_add_ext_out) in userspace */
+	uint64_t results;	/**< user address of count int64_t results */
+};
+
 /**
  * PXD_READ_DATA request from user space
  */
@@ -206,6 +313,17 @@ struct pxd_read_data_out {
 	uint32_t offset;	/**< offset into data */
 };
 
+/**
+ * PXD_READ_DATA request for a device added with PXD_ADD_FLAGS_CHECKSUM
+ *
+ * The checksum of the block at read_data.offset, which must be block
+ * aligned, goes to csum[0]. Only blocks copied in full are checksummed.
+ */
+struct pxd_read_data_csum_out {
+	struct pxd_read_data_out read_data;
+	uint64_t csum;		/**< user address of uint32_t array */
+};
+
 /**
  * PXD_UPDATE_SIZE ioctl from user space
  */
@@ -255,14 +373,22 @@ struct pxd_device* find_pxd_device(struct pxd_context *ctx, uint64_t dev_id);
 // No arguments necessary other than opcode
 #define PXD_FEATURE_FASTPATH (0x1)
 #define PXD_FEATURE_ATTACH_OPTIMIZED (0x2)
+#define PXD_FEATURE_BATCH (0x4)
+#define PXD_FEATURE_WRITE_ZEROES (0x8)
+#define PXD_FEATURE_IO_GEOMETRY (0x10)
+#define PXD_FEATURE_CHECKSUM (0x20)
 
 static inline
 int pxd_supported_features(void)
 {
-	int features = PXD_FEATURE_ATTACH_OPTIMIZED;
+	int features = PXD_FEATURE_ATTACH_OPTIMIZED | PXD_FEATURE_BATCH |
+		PXD_FEATURE_IO_GEOMETRY | PXD_FEATURE_CHECKSUM;
 #ifdef __PX_FASTPATH__
 	features |= PXD_FEATURE_FASTPATH;
 #endif
+#if defined(__PXKERNEL__) && LINUX_VERSION_CODE >= KERNEL_VERSION(4,10,0)
+	features |= PXD_FEATURE_WRITE_ZEROES;
+#endif
 
 	return features;
 }
@@ -368,6 +494,19 @@ struct pxd_ioctl_init_args {
 	struct pxd_dev_id devices[PXD_MAX_DEVICES];
 };
 
+/**
+ * PXD_IOC_INIT_GEN: PXD_IOC_INIT with device list generation.
+ *
+ * The device list is only returned when it changed since the generation
+ * passed in, otherwise just the header is filled.
+ */
+struct pxd_ioctl_init_gen_args {
+	uint64_t generation;	/**< in: last seen generation, out: current */
+	uint32_t changed;	/**< out: device list changed since generation */
+	uint32_t pad;
+	struct pxd_ioctl_init_args init;
+};
+
 /** sub-actions for PXD_IOC_IO_FLUSHER ioctl */
 enum pxd_io_flusher_action {
 	PXD_IO_FLUSHER_GET = 0,	/**<  check IO FLUSHER state of the process */
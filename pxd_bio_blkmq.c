@@ -19,6 +19,10 @@
 
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 8, 0) || defined(REQ_PREFLUSH)
 inline bool rq_is_special(struct request *rq) {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 12, 0)
+        if (req_op(rq) == REQ_OP_WRITE_ZEROES)
+                return true;
+#endif
         return (req_op(rq) == REQ_OP_DISCARD);
 }
 #else
@@ -400,6 +404,9 @@ clone_and_map(struct fp_root_context *fproot) {
         case REQ_OP_WRITE:
         case REQ_OP_FLUSH:
         case REQ_OP_DISCARD:
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 12, 0)
+        case REQ_OP_WRITE_ZEROES:
+#endif
                 break;
         default:
                 printk("blkmq fastpath: request %p: received unsupported "
@@ -575,6 +582,19 @@ static void fp_handle_specialops(struct work_struct *work) {
         q = bdev_get_queue(bdev);
 
         BUG_ON(!rq_is_special(rq));
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 12, 0)
+        if (req_op(rq) == REQ_OP_WRITE_ZEROES) {
+                atomic_inc(&pxd_dev->fp.nio_write_zeroes);
+                // replica offloads or unmaps if it can, else writes zeroes
+                r = blkdev_issue_zeroout(bdev, blk_rq_pos(rq),
+                                         blk_rq_sectors(rq), GFP_NOIO,
+                                         (rq->cmd_flags & REQ_NOUNMAP) ?
+                                         BLKDEV_ZERO_NOUNMAP : 0);
+                BIO_ENDIO(&cc->clone, r);
+                return;
+        }
+#endif
         atomic_inc(&pxd_dev->fp.nio_discard);
 
         // submit discard to replica
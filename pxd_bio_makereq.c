@@ -40,6 +40,10 @@ struct pxd_io_tracker {
 static void pxd_process_fileio(struct work_struct *wi);
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 8, 0)
 static inline bool special_op(unsigned int op) {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 12, 0)
+        if (op == REQ_OP_WRITE_ZEROES)
+                return true;
+#endif
         return (op == REQ_OP_DISCARD);
 }
 #else
@@ -458,6 +462,15 @@ static void fp_handle_special(struct work_struct *work) {
         struct page *pg = ZERO_PAGE(0); // global shared zero page
         int rc;
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 12, 0)
+        if (bio_op(b) == REQ_OP_WRITE_ZEROES) {
+                rc = blkdev_issue_zeroout(bdev, start, nsectors, GFP_NOIO,
+                                          (b->bi_opf & REQ_NOUNMAP) ?
+                                          BLKDEV_ZERO_NOUNMAP : 0);
+                BIO_ENDIO(b, rc);
+                return;
+        }
+#endif
         if (blk_queue_discard(q)) { // discard supported
                 rc = blkdev_issue_discard(bdev, start, nsectors, GFP_NOIO, 0);
         } else if (bdev_write_same(bdev)) { // convert discard to write same
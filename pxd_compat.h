@@ -22,6 +22,21 @@
 #define HAVE_BVEC_ITER
 #endif
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,15,0)
+#define FILE_OPEN_ROOT(root, name, flags, mode) \
+	file_open_root(root, name, flags, mode)
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(4,6,0)
+#define FILE_OPEN_ROOT(root, name, flags, mode) \
+	file_open_root((root)->dentry, (root)->mnt, name, flags, mode)
+#else
+#define FILE_OPEN_ROOT(root, name, flags, mode) \
+	file_open_root((root)->dentry, (root)->mnt, name, flags)
+#endif
+
+#ifndef u64_to_user_ptr
+#define u64_to_user_ptr(x) ((void __user *)(uintptr_t)(x))
+#endif
+
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(4,7,0) || defined(REQ_PREFLUSH)
 #define BLK_QUEUE_FLUSH(q) \
 	blk_queue_write_cache(q, true, true)
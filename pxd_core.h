@@ -26,6 +26,7 @@ struct pxd_context {
 	struct miscdevice miscdev;
 	struct delayed_work abort_work;
 	uint64_t open_seq;
+	uint64_t generation; /* bumped on device list changes, under lock */
 };
 
 struct pxd_context* find_context(unsigned ctx);
@@ -51,6 +52,12 @@ struct pxd_device {
 	bool fastpath; // this is persistent, how the block device registered with kernel
 	unsigned int queue_depth; // sysfs attribute bdev io queue depth
 	unsigned int discard_size;
+	unsigned int max_io_size;
+	unsigned int max_segments;
+	unsigned int io_opt;
+	unsigned int discard_granularity;
+	bool checksum; // crc32c data blocks copied to and from userspace
+	atomic64_t nr_csum_errors;
 
 #define PXD_ACTIVE(pxd_dev)  (atomic_read(&pxd_dev->ncount))
 	// congestion handling
@@ -65,6 +72,8 @@ struct pxd_device {
 
 	wait_queue_head_t remove_wait;
 	wait_queue_head_t suspend_wq;
+	int resume_pins; // [pxd_dev->lock protected] PXD_IOC_INIT resumes in flight
+	wait_queue_head_t resume_wait; // teardown waits here for resume_pins to drop
 #if defined(__PXD_BIO_BLKMQ__) && defined(__PX_BLKMQ__)
         struct blk_mq_tag_set tag_set;
 #endif
@@ -101,7 +110,7 @@ void pxd_check_q_decongested(struct pxd_device *pxd_dev);
 #define SECTOR_SHIFT (9)
 #endif
 
-#define SEGMENT_SIZE (1024 * 1024)
+#define SEGMENT_SIZE PXD_DEFAULT_IO
 
 #ifdef __PXD_BIO_MAKEREQ__
 void pxd_reroute_slowpath(struct request_queue *q, struct bio *bio);
@@ -11,6 +11,8 @@
 #include "pxd_compat.h"
 #include "kiolib.h"
 
+extern uint32_t pxd_write_zeroes;
+
 // global fastpath IO work queue
 static struct workqueue_struct *gwq;
 
@@ -225,6 +227,15 @@ int pxd_request_resume(struct pxd_device *pxd_dev)
 	return rc;
 }
 
+static struct file *pxd_open_backing(struct pxd_device *pxd_dev, int i, mode_t mode)
+{
+	const struct path *root = pxd_dev->fp.open_root;
+
+	if (root)
+		return FILE_OPEN_ROOT(root, pxd_dev->fp.device_path[i], mode, 0600);
+	return filp_open(pxd_dev->fp.device_path[i], mode, 0600);
+}
+
 /*
  * shall get called last when new device is added/updated or when fuse connection is lost
  * and re-estabilished.
@@ -253,7 +264,7 @@ void enableFastPath(struct pxd_device *pxd_dev, bool force)
 				printk("dev %llu:%s closing file desc %px\n",
 						pxd_dev->dev_id, __func__, fp->file[i]);
 				filp_close(fp->file[i], NULL);
-				f = filp_open(fp->device_path[i], mode, 0600);
+				f = pxd_open_backing(pxd_dev, i, mode);
 				if (IS_ERR_OR_NULL(f)) {
 					printk(KERN_ERR"Failed attaching path: device %llu, path %s err %ld\n",
 						pxd_dev->dev_id, fp->device_path[i], PTR_ERR(f));
@@ -263,7 +274,7 @@ void enableFastPath(struct pxd_device *pxd_dev, bool force)
 				f = fp->file[i];
 			}
 		} else {
-			f = filp_open(fp->device_path[i], mode, 0600);
+			f = pxd_open_backing(pxd_dev, i, mode);
 			if (IS_ERR_OR_NULL(f)) {
 				printk(KERN_ERR"Failed attaching path: device %llu, path %s err %ld\n",
 					pxd_dev->dev_id, fp->device_path[i], PTR_ERR(f));
@@ -392,6 +403,7 @@ int pxd_fastpath_init(struct pxd_device *pxd_dev)
 	INIT_LIST_HEAD(&fp->failQ);
 
 	atomic_set(&fp->nio_discard, 0);
+	atomic_set(&fp->nio_write_zeroes, 0);
 	atomic_set(&fp->nio_flush, 0);
 	atomic_set(&fp->nio_flush_nop, 0);
 	atomic_set(&fp->nio_preflush, 0);
@@ -504,8 +516,11 @@ void pxd_fastpath_adjust_limits(struct pxd_device *pxd_dev, struct request_queue
 	}
 
 	// ensure few block properties are still as expected.
+	// write zeroes need not be supported by the replicas, it falls back
+	// to zeroout in the fastpath.
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(4,10,0)
-	blk_queue_max_write_zeroes_sectors(topque, 0);
+	blk_queue_max_write_zeroes_sectors(topque,
+		pxd_write_zeroes ? pxd_dev->discard_size / SECTOR_SIZE : 0);
 #endif
 	blk_queue_logical_block_size(topque, PXD_LBS);
 	blk_queue_physical_block_size(topque, PXD_LBS);
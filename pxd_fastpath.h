@@ -53,7 +53,11 @@ struct pxd_fastpath_extension {
 	struct list_head failQ; // protected by fail_lock
 
 	char device_path[MAX_PXD_BACKING_DEVS][MAX_PXD_DEVPATH_LEN+1];
+	// root device_path is looked up under when opened on behalf of another
+	// task (batch add), NULL for the root of the current task
+	const struct path *open_root;
 	atomic_t nio_discard;
+	atomic_t nio_write_zeroes;
 	atomic_t nio_preflush;
 	atomic_t nio_flush;
 	atomic_t nio_flush_nop;
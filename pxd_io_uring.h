@@ -8,9 +8,11 @@
 #ifndef LINUX_IO_URING_H
 #define LINUX_IO_URING_H
 
-#include <linux/fs.h>
 #include <linux/types.h>
+#ifdef __KERNEL__
+#include <linux/fs.h>
 #include "fuse_i.h"
+#endif
 
 /*
  * IO submission data structure (Submission Queue Entry)
@@ -28,10 +30,18 @@ struct io_uring_sqe {
 		__u32		fsync_flags;
 		__u16		poll_events;
 		__u32		sync_range_flags;
+		__u32		msg_flags;
+		__s32		done_status;	/* IORING_OP_REQ_DONE request status */
+		__u32		timeout_flags;
 	};
 	__u64	user_data;	/* data to be passed back at completion time */
 	union {
-		__u16	buf_index;	/* index into fixed buffers, if used or context id */
+		struct {
+			__u16	buf_index;	/* index into fixed buffers, if used or context id */
+			__u16	__pad3;
+			__u32	copy_conn_id;	/* IORING_OP_COPY_DATA: context of the request */
+			__u64	copy_unique;	/* IORING_OP_COPY_DATA: unique id of the request */
+		};
 		__u64	__pad2[3];
 	};
 };
@@ -42,6 +52,8 @@ struct io_uring_sqe {
 #define IOSQE_FIXED_FILE	(1U << 0)	/* use fixed fileset */
 #define IOSQE_IO_DRAIN		(1U << 1)	/* issue after inflight IO */
 #define IOSQE_FORCE_ASYNC	(1U << 2)	/* force async i/o even if opened direct */
+#define IOSQE_BUFFER_SELECT	(1U << 3)	/* RECV into a provided buffer */
+#define IOSQE_IO_LINK		(1U << 4)	/* next sqe runs after this one */
 
 /*
  * io_uring_setup() flags
@@ -49,6 +61,7 @@ struct io_uring_sqe {
 #define IORING_SETUP_IOPOLL	(1U << 0)	/* io_context is polled */
 #define IORING_SETUP_SQPOLL	(1U << 1)	/* SQ poll thread */
 #define IORING_SETUP_SQ_AFF	(1U << 2)	/* sq_thread_cpu is valid */
+#define IORING_SETUP_ATTACH_WQ	(1U << 3)	/* share the SQ threads of wq_fd */
 
 #define IORING_OP_NOP		0
 #define IORING_OP_READV		1
@@ -70,12 +83,51 @@ struct io_uring_sqe {
 #define IORING_OP_SOCKET_POLl_REMOVE 17
 #define IORING_OP_SEND 18
 #define IORING_OP_RECV 19
+#define IORING_OP_PROVIDE_BUFFERS 20
+#define IORING_OP_TIMEOUT	21
+#define IORING_OP_LINK_TIMEOUT	22
+
+/*
+ * IORING_OP_SEND data source, in sqe->ioprio
+ */
+#define IORING_SEND_IOVEC	0	/* addr/len is a user iovec array */
+#define IORING_SEND_FIXED	1	/* addr/len inside fixed buffer buf_index */
+#define IORING_SEND_BIO		2	/* off/len of request addr on conn buf_index,
+					 * no MSG_ZEROCOPY */
+
+/*
+ * IORING_OP_REQ_DONE ends request addr on conn buf_index with done_status,
+ * as a reply written to the fuse device would. Linked behind the
+ * WRITE_BIO or SEND that serves the request it completes it without a
+ * syscall. If that entry fails the REQ_DONE is cancelled and the request
+ * is left for the server to end.
+ */
+
+/*
+ * IORING_OP_COPY_DATA copies len bytes at off of the request's data
+ * between the request pages and addr inside fixed buffer buf_index. The
+ * direction follows the request: write data is copied out to the buffer,
+ * a read request is filled from it.
+ */
+
+/*
+ * IORING_OP_TIMEOUT completes with -ETIME once the CLOCK_MONOTONIC timeout
+ * in sqe->off, in nanoseconds, expires. IORING_OP_LINK_TIMEOUT right behind
+ * an IOSQE_IO_LINK entry bounds that entry instead: on expiry a pending
+ * poll is cancelled and the timeout completes with -ETIME, if the entry
+ * completes first the timeout is cancelled with -ECANCELED.
+ */
+#define IORING_TIMEOUT_ABS	(1U << 0)	/* sqe->off is an absolute time */
 
 /*
  * sqe->fsync_flags
  */
 #define IORING_FSYNC_DATASYNC	(1U << 0)
 
+/*
+ * sqe->sync_range_flags are the SYNC_FILE_RANGE_* flags of sync_file_range(2)
+ */
+
 /*
  * IO completion data structure (Completion Queue Entry)
  */
@@ -85,6 +137,15 @@ struct io_uring_cqe {
 	__u32	flags;
 };
 
+/*
+ * cqe->flags
+ *
+ * IORING_CQE_F_BUFFER	the upper 16 bits are the id of the provided
+ *			buffer the data was received into
+ */
+#define IORING_CQE_F_BUFFER		(1U << 0)
+#define IORING_CQE_BUFFER_SHIFT		16
+
 /*
  * Magic offsets for the application to mmap the data it needs
  */
@@ -122,6 +183,16 @@ struct io_cqring_offsets {
 	__u64 resv[2];
 };
 
+/*
+ * responses_cb->w.cq_flags
+ */
+#define IORING_CQ_OVERFLOW	(1U << 0) /* completions wait in the backlog */
+
+/*
+ * responses_cb->w.cq_user_flags, only written by userspace
+ */
+#define IORING_CQ_USER_EVENTFD_DISABLED	(1U << 0) /* don't signal the eventfd */
+
 /*
  * io_uring_enter(2) flags
  */
@@ -137,7 +208,9 @@ struct io_uring_params {
 	__u32 flags;
 	__u32 sq_thread_cpu;
 	__u32 sq_thread_idle;
-	__u32 resv[5];
+	__u32 sq_threads;	/* number of SQ poll threads, 0 means 1 */
+	__u32 wq_fd;		/* ring to share SQ threads with, ATTACH_WQ */
+	__u32 resv[3];
 	struct io_sqring_offsets sq_off;
 	struct io_cqring_offsets cq_off;
 
@@ -0,0 +1,87 @@
+/*
+ * CQ posting microbenchmark for the px io ring.
+ *
+ * Sets up a ring on the io device and runs PXD_IOC_CQ_BENCH with 1, 2, 4 ...
+ * up to all online cpus posting completions, from softirq and from process
+ * context, printing completions per second and completions per tail update.
+ *
+ * The module must be built with PXD_CQ_BENCH=1, the bench needs CAP_SYS_ADMIN.
+ *
+ * build: cc -O2 -I.. -o pxd_cq_bench pxd_cq_bench.c
+ * usage: pxd_cq_bench [events per cpu] [burst]
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "pxd.h"
+#include "pxd_io_uring.h"
+
+#define PXD_IO_DEV "/dev/pxd/pxd-io"
+
+static int run(int fd, unsigned cpus, unsigned events, unsigned burst,
+	       unsigned flags)
+{
+	struct pxd_cq_bench b = {
+		.nr_cpus = cpus,
+		.nr_events = events,
+		.burst = burst,
+		.flags = flags,
+	};
+	double secs;
+
+	if (ioctl(fd, PXD_IOC_CQ_BENCH, &b) < 0) {
+		perror("PXD_IOC_CQ_BENCH");
+		return -1;
+	}
+
+	secs = b.elapsed_ns / 1e9;
+	printf("%-8s %5u %12.0f %10.1f %10llu\n",
+	       flags & PXD_CQ_BENCH_PROCESS ? "process" : "softirq", cpus,
+	       b.events / secs,
+	       b.flushes ? (double)b.events / b.flushes : 0.0,
+	       (unsigned long long)b.wakeups);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned events = argc > 1 ? strtoul(argv[1], NULL, 0) : 1000000;
+	unsigned burst = argc > 2 ? strtoul(argv[2], NULL, 0) : 32;
+	long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	struct io_uring_params params;
+	unsigned cpus;
+	int fd;
+
+	fd = open(PXD_IO_DEV, O_RDWR);
+	if (fd < 0) {
+		perror(PXD_IO_DEV);
+		return 1;
+	}
+	/* default ring sizes, no SQ threads: the bench consumes the CQ */
+	memset(&params, 0, sizeof(params));
+	if (ioctl(fd, PXD_IOC_INIT_IO, &params) < 0) {
+		perror("PXD_IOC_INIT_IO");
+		return 1;
+	}
+
+	printf("%u events per cpu, burst %u\n", events, burst);
+	printf("%-8s %5s %12s %10s %10s\n", "context", "cpus", "cqes/s",
+	       "cqes/tail", "wakeups");
+	for (cpus = 1; ; cpus = cpus * 2 < ncpus ? cpus * 2 : ncpus) {
+		if (run(fd, cpus, events, burst, 0) ||
+		    run(fd, cpus, events, burst, PXD_CQ_BENCH_PROCESS))
+			return 1;
+		if (cpus == ncpus)
+			break;
+	}
+
+	close(fd);
+	return 0;
+}